@@ -2,9 +2,49 @@
 #define GOLOMB_H
 
 #include <vector>
+#include <array>
+#include <algorithm>
+#include <numeric>
 #include <string>
+#include <span>
+#include <bit>
+#include <cstdint>
 #include <cmath>
 #include <stdexcept>
+#include "bit_stream/src/bit_stream.h"
+#include "profile.h"
+
+// Backward-adaptive Rice parameter, after LOCO-I (JPEG-LS): sum is a running total of
+// the recent mapped values (as coded, see GolombCoding) and count how many there were,
+// both halved every RESET values so that older values fade. k is the smallest with
+// count * 2^(k+1) >= sum, i.e. 2^k is at least half their mean: the LOCO-I rule for
+// interleaved values, and its equivalent for sign-magnitude ones. The coder updates it
+// after each value, in the encoder and the decoder alike, so it costs no side information.
+class AdaptiveRice {
+public:
+    static constexpr unsigned int RESET = 64;
+
+    // initialMean: mapped value expected before any has been seen
+    explicit AdaptiveRice(unsigned int initialMean = 4) : sum(std::max(initialMean, 1u)), count(1) {}
+
+    // 2^(k+1) >= sum / count, so k + 1 is the width of ceil(sum / count) - 1 (at least 1)
+    unsigned int parameter() const {
+        unsigned int t = sum > 0 ? (sum - 1) / count : 0;
+        return t > 1 ? static_cast<unsigned int>(std::bit_width(t)) - 1 : 0;
+    }
+
+    void update(unsigned int mapped) {
+        sum += mapped;
+        if (++count == RESET) {
+            sum >>= 1;
+            count >>= 1;
+        }
+    }
+
+private:
+    unsigned int sum;
+    unsigned int count;
+};
 
 class GolombCoding {
 public:
@@ -13,18 +53,38 @@ public:
         INTERLEAVED
     };
 
+    // Codes of up to LUT_BITS bits are decoded with a single table lookup
+    static constexpr int LUT_BITS = 10;
+
 private:
+    // length == 0 means the code is longer than LUT_BITS. A code that short
+    // has q < LUT_BITS and b < LUT_BITS, so the value always fits in 16 bits.
+    struct LutEntry {
+        int16_t value;
+        uint8_t length;
+    };
+
     unsigned int m;
     unsigned int b;
     unsigned int cutoff;
+    bool rice;      // m == 2^b: blocks take the Rice specializations (encodeWith<true>, ...)
     NegativeMode mode;
 
+    // Length limit: a quotient of maxQuotient or more is sent as maxQuotient zeros
+    // (no stop bit) followed by the mapped value in escapeBits plain bits
+    unsigned int maxQuotient = 0;   // 0: unlimited
+    int escapeBits = 0;
+
+    mutable std::array<LutEntry, 1 << LUT_BITS> lut;
+    mutable unsigned int lutM = 0; // m the table was built for (0: none yet)
+
     void calculateParameters() {
         if (m == 0) {
             throw std::invalid_argument("Golomb parameter m must be positive");
         }
-        b = static_cast<unsigned int>(std::floor(std::log2(m))); // floor(log2(m))
+        b = std::bit_width(m) - 1;    // floor(log2(m))
         cutoff = (1 << (b + 1)) - m;  // 2^(b+1) - m
+        rice = isPowerOfTwo(m);       // then cutoff == m and every r < cutoff
     }
 
     unsigned int mapToUnsigned(int value) const {
@@ -57,6 +117,14 @@ private:
         unsigned int q = n / m;
         unsigned int r = n % m;
         
+        if (maxQuotient != 0 && q >= maxQuotient) {
+            bits.insert(bits.end(), maxQuotient, false);
+            for (int i = escapeBits - 1; i >= 0; i--) {
+                bits.push_back((n >> i) & 1);
+            }
+            return bits;
+        }
+        
         for (unsigned int i = 0; i < q; i++) {
             bits.push_back(false);
         }
@@ -86,6 +154,16 @@ private:
         while (pos < bits.size() && !bits[pos]) {
             q++;
             pos++;
+            if (q == maxQuotient) {
+                if (pos + escapeBits > bits.size()) {
+                    throw std::invalid_argument("Incomplete escape code");
+                }
+                unsigned int n = 0;
+                for (int i = 0; i < escapeBits; i++) {
+                    n = (n << 1) | bits[pos++];
+                }
+                return {n, pos - start};
+            }
         }
         
         if (pos >= bits.size()) {
@@ -115,6 +193,160 @@ private:
         }
     }
 
+    // Enumerates the codewords in order of (non-decreasing) length and fills
+    // every table slot whose leading bits are that codeword
+    void buildLut() const {
+        lut.fill(LutEntry{0, 0});
+        lutM = m;
+
+        int signBits = (mode == SIGN_MAGNITUDE) ? 1 : 0;
+        for (unsigned int n = 0;; n++) {
+            unsigned int q = n / m;
+            unsigned int r = n % m;
+            if (maxQuotient != 0 && q >= maxQuotient) {
+                break; // Escapes are left to the slow path
+            }
+            uint32_t code = (r < cutoff) ? ((1u << b) | r) : ((1u << (b + 1)) | (r + cutoff));
+            int length = signBits + q + ((r < cutoff) ? b + 1 : b + 2);
+            if (length > LUT_BITS) {
+                break;
+            }
+
+            for (int sign = 0; sign <= signBits; sign++) {
+                uint32_t first = ((static_cast<uint32_t>(sign) << (length - 1)) | code) << (LUT_BITS - length);
+                uint32_t count = 1u << (LUT_BITS - length);
+                int value = signBits ? mapToSigned(n, sign) : mapToSigned(n);
+                for (uint32_t i = 0; i < count; i++) {
+                    lut[first + i] = LutEntry{static_cast<int16_t>(value), static_cast<uint8_t>(length)};
+                }
+            }
+        }
+    }
+
+    // Sign bit, unary quotient and tail (stop bit and remainder) of mapped value n, or
+    // its escape code
+    void writeCode(int value, unsigned int n, unsigned int q, uint64_t tail, int tailBits, BitStream& bs) const {
+        int signBits = (mode == SIGN_MAGNITUDE) ? 1 : 0;
+        if (maxQuotient != 0 && q >= maxQuotient) {
+            if (escapeBits < 32 && (n >> escapeBits) != 0) {
+                throw std::out_of_range("Value does not fit in the escape width");
+            }
+            PROFILE_UNARY(maxQuotient);
+            if (signBits) {
+                bs.write_bit(value < 0);
+            }
+            for (q = maxQuotient; q > 32; q -= 32) {
+                bs.write_n_bits(0, 32);
+            }
+            bs.write_n_bits(n, q + escapeBits);
+            return;
+        }
+        PROFILE_UNARY(q);
+
+        if (signBits + q + tailBits <= 64) {
+            if (signBits && value < 0) {
+                tail |= uint64_t(1) << (q + tailBits);
+            }
+            bs.write_n_bits(tail, signBits + q + tailBits);
+            return;
+        }
+
+        if (signBits) {
+            bs.write_bit(value < 0);
+        }
+        for (; q > 32; q -= 32) {
+            bs.write_n_bits(0, 32);
+        }
+        bs.write_n_bits(tail, q + tailBits);
+    }
+
+    // One codeword. Rice (m == 2^b, fixed at compile time): the quotient and remainder are
+    // a shift and a mask, and the remainder always takes b bits, with no cutoff test.
+    template <bool Rice>
+    void encodeWith(int value, BitStream& bs) const {
+        unsigned int n = mapToUnsigned(value);
+        if constexpr (Rice) {
+            writeCode(value, n, n >> b, (uint64_t(1) << b) | (n & (m - 1)), b + 1, bs);
+        } else {
+            unsigned int q = n / m;
+            unsigned int r = n % m;
+            if (r < cutoff) {
+                writeCode(value, n, q, (uint64_t(1) << b) | r, b + 1, bs);
+            } else {
+                writeCode(value, n, q, (uint64_t(1) << (b + 1)) | (r + cutoff), b + 2, bs);
+            }
+        }
+    }
+
+    template <bool Rice>
+    int decodeWith(BitStream& bs) const {
+        const LutEntry& entry = lut[bs.peek_bits(LUT_BITS)];
+        if (entry.length != 0) {
+            PROFILE_UNARY(Rice ? mapToUnsigned(entry.value) >> b : mapToUnsigned(entry.value) / m);
+            bs.consume_bits(entry.length);
+            return entry.value;
+        }
+
+        bool isNegative;
+        unsigned int q, n;
+        if (readPrefix(bs, isNegative, q, n)) {
+            return mapToSigned(n, isNegative);
+        }
+
+        if constexpr (Rice) {
+            n = q << b;
+            if (b != 0) {
+                n |= static_cast<unsigned int>(bs.peek_bits(b));
+                bs.consume_bits(b);
+            }
+        } else {
+            unsigned int r = static_cast<unsigned int>(bs.peek_bits(b + 1));
+            if ((r >> 1) < cutoff) {
+                r >>= 1;
+                bs.consume_bits(b);
+            } else {
+                r -= cutoff;
+                bs.consume_bits(b + 1);
+            }
+            n = q * m + r;
+        }
+        return mapToSigned(n, isNegative);
+    }
+
+    // Sign bit (sign-magnitude) and unary quotient of the next code. Returns true for an
+    // escape, with the mapped value already read into n.
+    bool readPrefix(BitStream& bs, bool& isNegative, unsigned int& q, unsigned int& n) const {
+        isNegative = false;
+        if (mode == SIGN_MAGNITUDE) {
+            isNegative = bs.peek_bits(1);
+            bs.consume_bits(1);
+        }
+
+        q = 0;
+        uint32_t window;
+        while ((window = static_cast<uint32_t>(bs.peek_bits(32))) == 0) {
+            if (bs.end_of_stream()) {
+                throw std::invalid_argument("Incomplete unary code");
+            }
+            if (maxQuotient != 0 && q + 32 >= maxQuotient) {
+                break;
+            }
+            bs.consume_bits(32);
+            q += 32;
+        }
+        int zeros = std::countl_zero(window); // 32 if window == 0
+        if (maxQuotient != 0 && q + zeros >= maxQuotient) {
+            bs.consume_bits(maxQuotient - q);
+            n = static_cast<unsigned int>(bs.read_n_bits(escapeBits));
+            PROFILE_UNARY(maxQuotient);
+            return true;
+        }
+        q += zeros;
+        PROFILE_UNARY(q);
+        bs.consume_bits(zeros + 1);
+        return false;
+    }
+
 public:
     GolombCoding(unsigned int m_param, NegativeMode neg_mode = INTERLEAVED)
         : m(m_param), mode(neg_mode) {
@@ -137,6 +369,41 @@ public:
         return bits;
     }
 
+    // Writes the codeword of value straight into bs: the unary run, the stop bit
+    // and the truncated-binary remainder go out as a single write_n_bits when
+    // they fit in 64 bits (always, unless the quotient is very large)
+    void encode(int value, BitStream& bs) const {
+        if (rice) {
+            encodeWith<true>(value, bs);
+        } else {
+            encodeWith<false>(value, bs);
+        }
+    }
+
+    // Rice code with the parameter 2^k of state, which then takes in the value. The
+    // codewords are those of encode() with m = 2^k; the lookup table is not used.
+    void encodeAdaptive(int value, AdaptiveRice& state, BitStream& bs) const {
+        unsigned int n = mapToUnsigned(value);
+        unsigned int k = state.parameter();
+        PROFILE_M(1u << k);
+        uint64_t tail = (uint64_t(1) << k) | (n & ((1u << k) - 1));
+        writeCode(value, n, n >> k, tail, k + 1, bs);
+        state.update(n);
+    }
+
+    // The Rice or the general coder is chosen once, for the whole block
+    void encodeBlock(std::span<const int> values, BitStream& bs) const {
+        if (rice) {
+            for (int value : values) {
+                encodeWith<true>(value, bs);
+            }
+        } else {
+            for (int value : values) {
+                encodeWith<false>(value, bs);
+            }
+        }
+    }
+
     std::pair<int, size_t> decode(const std::vector<bool>& bits, size_t start = 0) const {
         if (start >= bits.size()) {
             throw std::invalid_argument("Start position out of bounds");
@@ -162,6 +429,48 @@ public:
         return {result, bitsUsed};
     }
 
+    // Reads one codeword from bs. Short codes come from the lookup table; longer
+    // ones find the unary run with a count-leading-zeros on a peeked window.
+    int decode(BitStream& bs) const {
+        if (lutM != m) {
+            buildLut();
+        }
+        return rice ? decodeWith<true>(bs) : decodeWith<false>(bs);
+    }
+
+    // values.size() codewords, as written by encodeBlock()
+    void decodeBlock(std::span<int> values, BitStream& bs) const {
+        if (lutM != m) {
+            buildLut();
+        }
+        if (rice) {
+            for (int& value : values) {
+                value = decodeWith<true>(bs);
+            }
+        } else {
+            for (int& value : values) {
+                value = decodeWith<false>(bs);
+            }
+        }
+    }
+
+    // Reads a code written by encodeAdaptive(), with state where the encoder's was
+    int decodeAdaptive(AdaptiveRice& state, BitStream& bs) const {
+        PROFILE_M(1u << state.parameter());
+        bool isNegative;
+        unsigned int q, n;
+        if (!readPrefix(bs, isNegative, q, n)) {
+            unsigned int k = state.parameter();
+            n = q << k;
+            if (k != 0) {
+                n |= static_cast<unsigned int>(bs.peek_bits(k));
+                bs.consume_bits(k);
+            }
+        }
+        state.update(n);
+        return mapToSigned(n, isNegative);
+    }
+
     static std::string bitsToString(const std::vector<bool>& bits) {
         std::string result;
         for (bool bit : bits) {
@@ -172,11 +481,211 @@ public:
 
     unsigned int getM() const { return m; }
     NegativeMode getMode() const { return mode; }
+    bool isRice() const { return rice; }
+
+    static constexpr bool isPowerOfTwo(unsigned int v) { return v != 0 && (v & (v - 1)) == 0; }
+
+    // Nearest power of two to m (in the log domain), so that the Rice path is taken
+    static constexpr unsigned int nearestRiceParameter(unsigned int m) {
+        if (m <= 1) return 1;
+        unsigned int lower = std::bit_floor(m);
+        // m is closer to 2*lower than to lower when m^2 > 2*lower^2, i.e. m > lower*sqrt(2)
+        return (static_cast<uint64_t>(m) * m > 2ull * lower * lower) ? 2 * lower : lower;
+    }
     
     void setM(unsigned int new_m) {
         m = new_m;
         calculateParameters();
     }
+
+    // Bounds every code to about maxQ + escape_bits bits (plus the sign bit), so that
+    // a decoder never scans a long unary run. escape_bits must hold any mapped value
+    // (any magnitude in sign-magnitude mode). maxQ = 0 removes the limit.
+    void setEscape(unsigned int maxQ, int escape_bits) {
+        if (maxQ != 0 && (escape_bits < 1 || escape_bits > 32)) {
+            throw std::invalid_argument("Escape width must be 1 to 32 bits");
+        }
+        maxQuotient = maxQ;
+        escapeBits = maxQ != 0 ? escape_bits : 0;
+        lutM = 0; // The table depends on the limit
+    }
+
+    unsigned int getMaxQuotient() const { return maxQuotient; }
+};
+
+// Exact coded length of a block under candidate Golomb parameters, from one pass over
+// the block (add) that only builds a histogram of the mapped values. The histogram has
+// HISTOGRAM_SIZE bins and halves its resolution (bins of 2^shift values) whenever a value
+// does not fit. The candidates are the multiples of the bin width: such an m, and its
+// truncated-binary cutoff, both split on bin boundaries, so the count of values reaching
+// each quotient, and of remainders past the cutoff, is read off the cumulative histogram
+// in O(bins / m). The length limit (setEscape) is not modelled, as escapes are meant to
+// be rare.
+class GolombCostModel {
+public:
+    static constexpr unsigned int HISTOGRAM_SIZE = 256;
+    static constexpr unsigned int MAX_M = 65535;    // Parameters are stored in 16 bits
+
+    explicit GolombCostModel(GolombCoding::NegativeMode neg_mode = GolombCoding::INTERLEAVED)
+        : mode(neg_mode), histogram(HISTOGRAM_SIZE, 0), cumulative(HISTOGRAM_SIZE, 0) {}
+
+    void reset() {
+        std::fill_n(histogram.begin(), (maxValue >> shift) + 1, 0);
+        count = 0;
+        maxValue = 0;
+        shift = 0;
+    }
+
+    void add(int value) {
+        unsigned int n = map(value);
+        if (n > maxValue) {
+            while ((n >> shift) >= HISTOGRAM_SIZE) {
+                halveResolution();
+            }
+            maxValue = n;
+        }
+        histogram[n >> shift]++;
+        count++;
+    }
+
+    void addBlock(std::span<const int> values) {
+        for (int value : values) {
+            add(value);
+        }
+    }
+
+    size_t size() const { return count; }
+
+    // Histogram bin width; only its multiples can be costed
+    unsigned int resolution() const { return 1u << shift; }
+
+    // To be called after the last add(), before bits()
+    void prepare() {
+        std::partial_sum(histogram.begin(), histogram.begin() + (maxValue >> shift) + 1, cumulative.begin());
+    }
+
+    // Bits needed for the block with m, a multiple of resolution()
+    uint64_t bits(unsigned int m) const {
+        unsigned int b = std::bit_width(m) - 1;
+        uint64_t bins = m >> shift;
+        uint64_t cutoff = ((2u << b) - m) >> shift;     // At least 1 (m itself for Rice)
+        uint64_t last = maxValue >> shift;
+        uint64_t total = count * (b + 1 + signBits());
+        // Each value adds one bit per multiple of m it reaches (its quotient)...
+        for (uint64_t base = bins; base <= last; base += bins) {
+            total += count - cumulative[base - 1];
+        }
+        // ...and one more when its remainder takes the long truncated-binary code
+        if (cutoff < bins) {
+            for (uint64_t base = 0; base + cutoff <= last; base += bins) {
+                total += cumulative[std::min(base + bins - 1, last)] - cumulative[base + cutoff - 1];
+            }
+        }
+        return total;
+    }
+
+    // Parameter giving the shortest block. The best Rice parameter 2^k is searched first;
+    // a better Golomb m is looked for between its neighbours 2^(k-1) and 2^(k+1), in
+    // steps of resolution(). A Rice parameter wins ties, as it decodes faster. The length
+    // of the block with it goes to blockBits, if given (UINT64_MAX if it was not costed).
+    unsigned int bestParameter(bool riceOnly, uint64_t* blockBits = nullptr) {
+        if (blockBits) {
+            *blockBits = count == 0 ? 0 : UINT64_MAX;
+        }
+        if (count == 0) {
+            return 1;
+        }
+        if ((1u << shift) > (MAX_M + 1) / 2) {
+            return (MAX_M + 1) / 2; // Values too large for any m to be costed
+        }
+        prepare();
+
+        unsigned int bestK = shift;
+        uint64_t bestBits = bits(1u << shift);
+        for (unsigned int k = shift + 1; (1u << k) <= MAX_M; k++) {
+            uint64_t kBits = bits(1u << k);
+            if (kBits >= bestBits) {
+                break; // The cost only grows from here
+            }
+            bestBits = kBits;
+            bestK = k;
+        }
+
+        unsigned int best = 1u << bestK;
+        if (riceOnly || bestK == 0) {
+            if (blockBits) {
+                *blockBits = bestBits;
+            }
+            return best;
+        }
+
+        unsigned int step = resolution();
+        unsigned int first = ((1u << (bestK - 1)) / step + 1) * step;
+        unsigned int last = std::min((2u << bestK) - 1, MAX_M);
+        for (unsigned int m = first; m <= last; m += step) {
+            if (GolombCoding::isPowerOfTwo(m)) {
+                continue;
+            }
+            uint64_t mBits = bits(m);
+            if (mBits < bestBits) {
+                bestBits = mBits;
+                best = m;
+            }
+        }
+        if (blockBits) {
+            *blockBits = bestBits;
+        }
+        return best;
+    }
+
+    // The former estimate, from the mean magnitude assuming a geometric distribution:
+    // m = ceil(-1 / log2(p)) with p = mean / (mean + 1). Cheaper, but often one or two
+    // off the best m; kept for comparison (bench_entropy).
+    static unsigned int estimateFromMean(std::span<const int> values, bool riceOnly) {
+        if (values.empty()) return 1;
+
+        double mean = std::accumulate(values.begin(), values.end(), 0.0,
+                                      [](double sum, int r) { return sum + std::abs(r); })
+                      / values.size();
+
+        if (mean < 0.5) return 1;
+
+        double p = mean / (mean + 1.0);
+        unsigned int m = static_cast<unsigned int>(std::ceil(-1.0 / std::log2(p)));
+        m = std::clamp(m, 1u, MAX_M);
+        return riceOnly ? std::min(GolombCoding::nearestRiceParameter(m), 32768u) : m;
+    }
+
+private:
+    // As GolombCoding maps values, without branches (the signs of residuals are random)
+    unsigned int map(int value) const {
+        unsigned int bits = static_cast<unsigned int>(value);
+        unsigned int sign = static_cast<unsigned int>(value >> 31);
+        if (mode == GolombCoding::SIGN_MAGNITUDE) {
+            return (bits ^ sign) - sign;
+        }
+        return (bits << 1) ^ sign;
+    }
+
+    unsigned int signBits() const { return mode == GolombCoding::SIGN_MAGNITUDE ? 1 : 0; }
+
+    // Merges bins in pairs; only the bins up to the largest value so far are in use
+    void halveResolution() {
+        unsigned int used = (maxValue >> shift) + 1;
+        unsigned int merged = (used + 1) / 2;
+        for (unsigned int i = 0; i < merged; i++) {
+            histogram[i] = histogram[2 * i] + (2 * i + 1 < used ? histogram[2 * i + 1] : 0);
+        }
+        std::fill(histogram.begin() + merged, histogram.begin() + used, 0);
+        shift++;
+    }
+
+    GolombCoding::NegativeMode mode;
+    size_t count = 0;
+    unsigned int maxValue = 0;
+    unsigned int shift = 0;
+    std::vector<uint32_t> histogram;
+    std::vector<uint32_t> cumulative;
 };
 
-#endif
\ No newline at end of file
+#endif
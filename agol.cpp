@@ -0,0 +1,1293 @@
+#include "agol.h"
+#include "lpc.h"
+#include "profile.h"
+#include "thread_pool.h"
+#include <string>
+#include <cstring>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <bit>
+#include <type_traits>
+
+namespace agol {
+
+// Bits of the predictor sent before each block under PredictorType::ADAPTIVE
+const int PREDICTOR_BITS = 3;
+
+// Bits of the stereo mode sent before each stereo block under StereoMode::ADAPTIVE
+const int STEREO_BITS = 2;
+
+// The predictors look back at most MAX_HISTORY samples, which may be in the previous block
+const size_t MAX_HISTORY = LpcFilter::MAX_ORDER;
+
+// Mapped residual the per-sample Golomb parameter (-a) starts from: twice the JPEG-LS
+// initial magnitude, (range + 32) / 64, for 16-bit samples
+const unsigned int RICE_INITIAL_MEAN = 2048;
+
+// One channel of the block being coded, preceded by the last samples of the
+// previous block so that prediction carries on across block boundaries
+struct ChannelBlock {
+    std::vector<int32_t> data;
+    size_t history = 0;     // valid samples before the block (fewer at the start of the file)
+    AdaptiveRice rice{RICE_INITIAL_MEAN}; // Per-sample parameter (-a), restarted with the history
+    LpcFilter lpc;          // LPC predictor of the current frame
+    
+    // maxBlock: largest block to be coded
+    explicit ChannelBlock(size_t maxBlock = BLOCK_SIZE) : data(MAX_HISTORY + maxBlock) {}
+    
+    // Start of a frame: no history, and the parameter and filter as they start
+    void restart() {
+        history = 0;
+        rice = AdaptiveRice(RICE_INITIAL_MEAN);
+        lpc = LpcFilter();
+    }
+    
+    int32_t* samples() { return data.data() + MAX_HISTORY; }
+    
+    // The state of other, to code the next block from as it would: its history, parameter
+    // and filter (the samples of the block are written before they are read)
+    void resumeFrom(const ChannelBlock& other) {
+        std::copy_n(other.data.begin() + (MAX_HISTORY - other.history), other.history,
+                    data.begin() + (MAX_HISTORY - other.history));
+        history = other.history;
+        rice = other.rice;
+        lpc = other.lpc;
+    }
+    
+    // Done with a block of n samples: its last samples become the history
+    void carry(size_t n) {
+        size_t keep = std::min(MAX_HISTORY, history + n);
+        std::memmove(data.data() + MAX_HISTORY - keep, samples() + n - keep, keep * sizeof(int32_t));
+        history = keep;
+    }
+    
+    // Shift the history and the n samples of the block right by k bits (see
+    // BlockType::WASTED), and the block back; the history is restored as it was
+    void shiftOut(size_t n, int k) {
+        std::copy_n(samples() - history, history, savedHistory.begin());
+        for (int32_t* p = samples() - history; p < samples() + n; p++) {
+            *p >>= k;
+        }
+    }
+    
+    void shiftIn(size_t n, int k) {
+        for (int32_t* p = samples(); p < samples() + n; p++) {
+            *p = static_cast<int32_t>(static_cast<uint32_t>(*p) << k);
+        }
+        std::copy_n(savedHistory.begin(), history, samples() - history);
+    }
+    
+    std::array<int32_t, MAX_HISTORY> savedHistory{};  // Kept by shiftOut() for shiftIn()
+};
+
+// Samples a predictor needs before it can predict (stored verbatim at a frame start)
+size_t predictorOrder(PredictorType predictor, const LpcFilter& lpc) {
+    switch (predictor) {
+        case PredictorType::ORDER_1: return 1;
+        case PredictorType::ORDER_2: return 2;
+        case PredictorType::ORDER_3: return 3;
+        case PredictorType::LPC: return lpc.order;
+        case PredictorType::ORDER_0: return 0;
+        case PredictorType::ORDER_4: return 4;
+        case PredictorType::ADAPTIVE: break;
+    }
+    return 0;
+}
+
+// Whether frames start with LPC filters
+bool usesLpc(PredictorType predictor) {
+    return predictor == PredictorType::LPC || predictor == PredictorType::ADAPTIVE;
+}
+
+// Predict x[0] from the samples before it; history is how many of those exist
+int32_t predict(const int32_t* x, size_t history, PredictorType predictor, const LpcFilter& lpc) {
+    if (history == 0) return 0;
+    
+    auto clamp = [](int32_t val) { 
+        return std::clamp(val, -32768, 32767); 
+    };
+    
+    switch (predictor) {
+        case PredictorType::ORDER_1:
+            return x[-1];
+            
+        case PredictorType::ORDER_2:
+            if (history < 2) return x[-1];
+            return clamp(2 * x[-1] - x[-2]);
+            
+        case PredictorType::ORDER_3:
+            if (history < 2) return x[-1];
+            if (history < 3) return clamp(2 * x[-1] - x[-2]);
+            return clamp(3 * x[-1] - 3 * x[-2] + x[-3]);
+            
+        case PredictorType::ORDER_4:
+            if (history < 2) return x[-1];
+            if (history < 3) return clamp(2 * x[-1] - x[-2]);
+            if (history < 4) return clamp(3 * x[-1] - 3 * x[-2] + x[-3]);
+            return clamp(4 * x[-1] - 6 * x[-2] + 4 * x[-3] - x[-4]);
+            
+        case PredictorType::LPC:
+            // Fewer samples than the filter order after the warm-up (a block shorter than
+            // the order): the fixed predictors stand in until there are enough
+            if (history < static_cast<size_t>(lpc.order)) return predict(x, history, PredictorType::ORDER_4, lpc);
+            return clamp(lpc.predict(x));
+            
+        default:
+            return 0;
+    }
+}
+
+// Sums of the residual magnitudes of the fixed predictors of orders 0 to 4 (as predict()
+// computes them) over the n samples of x, which all have at least four before them. One
+// branch-free pass that the compiler vectorizes; the sums fit in 32 bits, as residuals
+// are below 2^17 and n is at most MAX_BLOCK_SIZE.
+std::array<uint32_t, 5> fixedResidualSums(const int32_t* x, size_t n) {
+    auto clamp = [](int32_t val) {
+        return std::clamp(val, -32768, 32767);
+    };
+    uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0, s4 = 0;
+    for (size_t i = 0; i < n; i++) {
+        int32_t a = x[i - 1], b = x[i - 2], c = x[i - 3], d = x[i - 4];
+        s0 += std::abs(x[i]);
+        s1 += std::abs(x[i] - a);
+        s2 += std::abs(x[i] - clamp(2 * a - b));
+        s3 += std::abs(x[i] - clamp(3 * a - 3 * b + c));
+        s4 += std::abs(x[i] - clamp(4 * a - 6 * b + 4 * c - d));
+    }
+    return {s0, s1, s2, s3, s4};
+}
+
+// Samples stored verbatim (see INDEPENDENT_FRAMES, BlockType::CONSTANT) take WARMUP_BITS
+const int WARMUP_BITS = 17;     // Enough for the side channel
+
+// How a channel block is coded, in BLOCK_TYPE_BITS before it
+enum class BlockType {
+    PREDICTED = 0,      // Predictor, warm-up, m and residuals (see encodePredicted)
+    CONSTANT = 1,       // One value, in WARMUP_BITS bits, for every sample
+    VERBATIM = 2,       // A width in VERBATIM_WIDTH_BITS, then each sample in that many bits
+    WASTED = 3          // A shift in WASTED_SHIFT_BITS, then the samples (and their
+                        // history) shifted right by it, as a PREDICTED block
+};
+
+const int BLOCK_TYPE_BITS = 2;
+const int VERBATIM_WIDTH_BITS = 5;
+const int WASTED_SHIFT_BITS = 4;
+const int MAX_WASTED_BITS = 15;
+
+// Value of the header adaptive field for a per-sample m (-a); 0 is a fixed m and 1 one
+// m per block, sent before it
+const int ADAPTIVE_PER_SAMPLE = 2;
+
+// Version 2 header: "AGOL", a zero where version 1 has the channel count, the version
+// and then the fields. From version 5 the version and the fields are big-endian, 32 bits
+// each (the frame count 64), so that files move between machines; before, they were in
+// the writer's native byte order.
+void writeHeader(BitStream& bs, const AgolHeader& header) {
+    int predType = static_cast<int>(header.predictor);
+    int stereoType = static_cast<int>(header.stereoMode);
+    int adaptive = header.perSampleM ? ADAPTIVE_PER_SAMPLE : header.adaptiveM ? 1 : 0;
+    int negMode = static_cast<int>(header.negativeMode);
+    
+    auto field = [&](auto value) {
+        bs.write_n_bits(static_cast<std::make_unsigned_t<decltype(value)>>(value), 8 * sizeof value);
+    };
+    
+    bs.write_bytes("AGOL", 4);
+    field(0);
+    field(header.version);
+    field(header.channels);
+    field(header.sampleRate);
+    field(header.frames);
+    field(predType);
+    field(stereoType);
+    field(adaptive);
+    field(header.fixedM);
+    field(negMode);
+    field(header.maxQuotient);
+    field(header.frameSize);
+    field(header.blockSize);
+}
+
+// Reads a header of any version; throws std::runtime_error if it is not a valid one
+void readHeader(BitStream& bs, AgolHeader& header) {
+    char magic[4];
+    bs.read_bytes(magic, 4);
+    if (std::string(magic, 4) != "AGOL") {
+        throw std::runtime_error("not a valid AGOL audio file");
+    }
+    
+    // Versions 2 to 4 were written in the byte order of the machine, and are read only in
+    // that of this one (a file from a machine of the other order is not recognised);
+    // versions 5 and later, big-endian, never read as one of them
+    int first;
+    bs.read_bytes(&first, sizeof(int));
+    if (first != 0) {
+        header.version = 1;
+        header.channels = first;
+    } else {
+        uint8_t version[4];
+        bs.read_bytes(version, 4);
+        std::memcpy(&header.version, version, sizeof(int));
+        if (header.version < 2 || header.version > 4) {
+            header.version = static_cast<int>(uint32_t(version[0]) << 24 | uint32_t(version[1]) << 16
+                                              | uint32_t(version[2]) << 8 | version[3]);
+            if (header.version < 5 || header.version > AGOL_VERSION) {
+                throw std::runtime_error("unsupported AGOL version " + std::to_string(header.version));
+            }
+        }
+    }
+    
+    bool bigEndian = header.version >= 5;
+    auto field = [&](auto& value) {
+        if (bigEndian) {
+            value = static_cast<std::remove_reference_t<decltype(value)>>(bs.read_n_bits(8 * sizeof value));
+        } else {
+            bs.read_bytes(&value, sizeof value);
+        }
+    };
+    
+    if (header.version != 1) {
+        field(header.channels);
+    }
+    int predType, stereoType, adaptive, negMode;
+    field(header.sampleRate);
+    field(header.frames);
+    field(predType);
+    field(stereoType);
+    field(adaptive);
+    field(header.fixedM);
+    field(negMode);
+    
+    if (header.version == 1) {
+        // Layout flags and the unary length limit (-q) were kept in spare bits
+        header.layout = stereoType & ~0xff;
+        header.maxQuotient = static_cast<unsigned int>(negMode) >> 8;
+        header.frameSize = FRAME_SIZE;
+        stereoType &= 0xff;
+        negMode &= 0xff;
+    } else {
+        field(header.maxQuotient);
+        field(header.frameSize);
+    }
+    header.blockSize = BLOCK_SIZE;
+    if (header.version >= 4) {
+        field(header.blockSize);
+    }
+    
+    if (predType < 0 || predType > static_cast<int>(PredictorType::ADAPTIVE)
+        || stereoType < 0 || stereoType > static_cast<int>(StereoMode::ADAPTIVE)
+        || (negMode != GolombCoding::SIGN_MAGNITUDE && negMode != GolombCoding::INTERLEAVED)) {
+        throw std::runtime_error("corrupt AGOL header");
+    }
+    header.predictor = static_cast<PredictorType>(predType);
+    header.stereoMode = static_cast<StereoMode>(stereoType);
+    header.adaptiveM = adaptive != 0;
+    header.perSampleM = adaptive == ADAPTIVE_PER_SAMPLE;
+    header.negativeMode = static_cast<GolombCoding::NegativeMode>(negMode);
+    
+    if (header.channels != 1 && header.channels != 2) {
+        throw std::runtime_error("only mono and stereo audio supported");
+    }
+    bool validBlocks = header.blockSize == 0
+        ? header.frameSize >= MIN_BLOCK_SIZE && header.frameSize <= MAX_BLOCK_SIZE
+              && header.frameSize % MIN_BLOCK_SIZE == 0
+              && std::has_single_bit(header.frameSize / MIN_BLOCK_SIZE)
+        : header.blockSize >= MIN_FIXED_BLOCK_SIZE && header.blockSize <= MAX_BLOCK_SIZE
+              && header.frameSize % header.blockSize == 0;
+    if (header.frames < 0 || header.frameSize == 0 || !validBlocks) {
+        throw std::runtime_error("corrupt AGOL header");
+    }
+}
+
+// Golomb parameter giving the fewest bits for the residuals, from their exact coded
+// length under each candidate (see GolombCostModel). With riceOnly, m is a power of two.
+unsigned int selectGolombParameter(const std::vector<int>& residuals, bool riceOnly, GolombCostModel& costs) {
+    PROFILE_SCOPE(PARAMETERS);
+    costs.reset();
+    costs.addBlock(residuals);
+    return costs.bestParameter(riceOnly);
+}
+
+// The stereo kernels below are plain loops over restrict pointers, which the compiler
+// vectorizes; on x86-64 each is also built for AVX2 and the version the CPU supports is
+// picked when the program loads (SSE2 otherwise). Not under ThreadSanitizer, whose
+// runtime is not up yet when the loader picks them.
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__) && !defined(__SANITIZE_THREAD__)
+#define STEREO_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define STEREO_KERNEL
+#endif
+
+// Split a block of n interleaved stereo frames into mid-side channels
+// Using the lossless formulation: mid = (L+R)/2, side = L-R (17 bits)
+// Then recover: L = mid + (side+1)/2, R = mid - (side+1)/2 when side is odd
+STEREO_KERNEL void convertToMidSide(const int16_t* __restrict frames, size_t n, int32_t* __restrict mid, int32_t* __restrict side) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t l = frames[2 * i];
+        int32_t r = frames[2 * i + 1];
+        mid[i] = (l + r) >> 1;
+        side[i] = l - r;
+    }
+}
+
+// Join mid-side channels back into n interleaved stereo frames
+STEREO_KERNEL void convertFromMidSide(const int32_t* __restrict mid, const int32_t* __restrict side, size_t n, int16_t* __restrict frames) {
+    for (size_t i = 0; i < n; i++) {
+        int32_t m = mid[i];
+        int32_t s = side[i];
+        // Lossless recovery
+        frames[2 * i] = static_cast<int16_t>(m + (s >> 1) + (s & 1));
+        frames[2 * i + 1] = static_cast<int16_t>(m - (s >> 1));
+    }
+}
+
+// Same, for independently coded channels
+STEREO_KERNEL void deinterleave(const int16_t* __restrict frames, size_t n, int32_t* __restrict left, int32_t* __restrict right) {
+    for (size_t i = 0; i < n; i++) {
+        left[i] = frames[2 * i];
+        right[i] = frames[2 * i + 1];
+    }
+}
+
+STEREO_KERNEL void interleave(const int32_t* __restrict left, const int32_t* __restrict right, size_t n, int16_t* __restrict frames) {
+    for (size_t i = 0; i < n; i++) {
+        frames[2 * i] = static_cast<int16_t>(left[i]);
+        frames[2 * i + 1] = static_cast<int16_t>(right[i]);
+    }
+}
+
+// Same, for a left (or right) channel and the side channel
+STEREO_KERNEL void convertToLeftSide(const int16_t* __restrict frames, size_t n, int32_t* __restrict left, int32_t* __restrict side) {
+    for (size_t i = 0; i < n; i++) {
+        left[i] = frames[2 * i];
+        side[i] = frames[2 * i] - frames[2 * i + 1];
+    }
+}
+
+STEREO_KERNEL void convertFromLeftSide(const int32_t* __restrict left, const int32_t* __restrict side, size_t n, int16_t* __restrict frames) {
+    for (size_t i = 0; i < n; i++) {
+        frames[2 * i] = static_cast<int16_t>(left[i]);
+        frames[2 * i + 1] = static_cast<int16_t>(left[i] - side[i]);
+    }
+}
+
+STEREO_KERNEL void convertToRightSide(const int16_t* __restrict frames, size_t n, int32_t* __restrict right, int32_t* __restrict side) {
+    for (size_t i = 0; i < n; i++) {
+        right[i] = frames[2 * i + 1];
+        side[i] = frames[2 * i] - frames[2 * i + 1];
+    }
+}
+
+STEREO_KERNEL void convertFromRightSide(const int32_t* __restrict right, const int32_t* __restrict side, size_t n, int16_t* __restrict frames) {
+    for (size_t i = 0; i < n; i++) {
+        frames[2 * i] = static_cast<int16_t>(right[i] + side[i]);
+        frames[2 * i + 1] = static_cast<int16_t>(right[i]);
+    }
+}
+
+// n interleaved frames to the coded channels a (and b), and back
+void splitChannels(const int16_t* frames, size_t n, int channels, StereoMode mode, int32_t* a, int32_t* b) {
+    if (channels == 1) {
+        std::copy_n(frames, n, a);
+        return;
+    }
+    switch (mode) {
+        case StereoMode::MID_SIDE: convertToMidSide(frames, n, a, b); break;
+        case StereoMode::LEFT_SIDE: convertToLeftSide(frames, n, a, b); break;
+        case StereoMode::RIGHT_SIDE: convertToRightSide(frames, n, a, b); break;
+        default: deinterleave(frames, n, a, b); break;
+    }
+}
+
+void joinChannels(const int32_t* a, const int32_t* b, size_t n, int channels, StereoMode mode, int16_t* frames) {
+    if (channels == 1) {
+        std::copy_n(a, n, frames);
+        return;
+    }
+    switch (mode) {
+        case StereoMode::MID_SIDE: convertFromMidSide(a, b, n, frames); break;
+        case StereoMode::LEFT_SIDE: convertFromLeftSide(a, b, n, frames); break;
+        case StereoMode::RIGHT_SIDE: convertFromRightSide(a, b, n, frames); break;
+        default: interleave(a, b, n, frames); break;
+    }
+}
+
+// Stereo mode for a block of n frames under StereoMode::ADAPTIVE, history frames (up to
+// MAX_HISTORY) being valid before it. Each of left, right, mid and side is costed by the
+// residual magnitude sum of its best fixed predictor (see fixedResidualSums), and the
+// mode whose two channels add up to the least is chosen, as FLAC does. scratch holds the
+// four channels; it is kept by the caller from one block to the next.
+StereoMode selectStereoMode(const int16_t* frames, size_t n, size_t history, std::vector<int32_t>& scratch) {
+    PROFILE_SCOPE(DECORRELATION);
+    size_t h = std::min<size_t>(history, 4);
+    size_t len = h + n;
+    if (len <= 4) {
+        return StereoMode::MID_SIDE;
+    }
+    
+    scratch.resize(4 * len);
+    int32_t* left = scratch.data();
+    int32_t* right = left + len;
+    int32_t* mid = right + len;
+    int32_t* side = mid + len;
+    const int16_t* start = frames - h * 2;
+    deinterleave(start, len, left, right);
+    convertToMidSide(start, len, mid, side);
+    
+    auto cost = [&](const int32_t* x) {
+        std::array<uint32_t, 5> sums = fixedResidualSums(x + 4, len - 4);
+        return static_cast<uint64_t>(*std::min_element(sums.begin(), sums.end()));
+    };
+    uint64_t l = cost(left), r = cost(right), m = cost(mid), s = cost(side);
+    
+    std::array<std::pair<uint64_t, StereoMode>, STEREO_MODES> modes = {{
+        {l + r, StereoMode::INDEPENDENT}, {m + s, StereoMode::MID_SIDE},
+        {l + s, StereoMode::LEFT_SIDE}, {r + s, StereoMode::RIGHT_SIDE}
+    }};
+    return std::min_element(modes.begin(), modes.end(),
+                            [](const auto& a, const auto& b) { return a.first < b.first; })->second;
+}
+
+// Under StereoMode::ADAPTIVE the coded channels may change from block to block: the
+// history before a block is rebuilt in the block's mode from the frames before it
+void restoreHistory(ChannelBlock ch[2], const int16_t* frames, int channels, StereoMode mode) {
+    size_t h = ch[0].history;
+    splitChannels(frames - h * channels, h, channels, mode, ch[0].samples() - h, ch[1].samples() - h);
+}
+
+// Residuals of samples verbatim to n of a channel block under predictor
+void computeResiduals(ChannelBlock& ch, size_t n, size_t verbatim, PredictorType predictor,
+                      std::vector<int>& residuals) {
+    PROFILE_SCOPE(PREDICTION);
+    const int32_t* x = ch.samples();
+    residuals.clear();
+    for (size_t i = verbatim; i < n; i++) {
+        int32_t prediction = predict(x + i, std::min(MAX_HISTORY, ch.history + i), predictor, ch.lpc);
+        residuals.push_back(x[i] - prediction);
+    }
+}
+
+// Predictor for a block under PredictorType::ADAPTIVE. The fixed orders 0 to 4, and the
+// frame's LPC filter if it has one, are ranked by the sum of their residual magnitudes
+// over the samples all of them can predict (the fixed ones in one pass, see
+// fixedResidualSums). When m is chosen per block, the two best are then costed exactly,
+// warm-up included, and the shorter is kept.
+PredictorType selectPredictor(ChannelBlock& ch, size_t n, bool warmUp, const EncoderConfig& config,
+                              std::vector<int>& residuals, GolombCostModel& costs) {
+    PROFILE_SCOPE(PREDICTION);
+    const int32_t* x = ch.samples();
+    size_t needed = std::max<size_t>(4, ch.lpc.order);
+    size_t from = std::min(n, needed - std::min(needed, ch.history));
+    
+    std::array<uint32_t, 5> fixed = fixedResidualSums(x + from, n - from);
+    std::vector<std::pair<uint64_t, PredictorType>> ranked = {
+        {fixed[0], PredictorType::ORDER_0}, {fixed[1], PredictorType::ORDER_1},
+        {fixed[2], PredictorType::ORDER_2}, {fixed[3], PredictorType::ORDER_3},
+        {fixed[4], PredictorType::ORDER_4}
+    };
+    if (ch.lpc.order > 0) {
+        uint64_t sum = 0;
+        for (size_t i = from; i < n; i++) {
+            sum += std::abs(x[i] - predict(x + i, MAX_HISTORY, PredictorType::LPC, ch.lpc));
+        }
+        ranked.push_back({sum, PredictorType::LPC});
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+                     [](const auto& a, const auto& b) { return a.first < b.first; });
+    
+    if (!config.adaptiveM || config.perSampleM) {
+        return ranked[0].second;
+    }
+    
+    PredictorType best = ranked[0].second;
+    uint64_t bestBits = UINT64_MAX;
+    for (size_t c = 0; c < 2; c++) {
+        PredictorType predictor = ranked[c].second;
+        size_t verbatim = warmUp ? std::min(predictorOrder(predictor, ch.lpc), n) : 0;
+        computeResiduals(ch, n, verbatim, predictor, residuals);
+        PROFILE_SCOPE(PARAMETERS);
+        costs.reset();
+        costs.addBlock(residuals);
+        uint64_t bits;
+        costs.bestParameter(config.riceOnly, &bits);
+        if (bits != UINT64_MAX) {
+            bits += verbatim * WARMUP_BITS;
+        }
+        if (bits < bestBits) {
+            bestBits = bits;
+            best = predictor;
+        }
+    }
+    return best;
+}
+
+// Encode the n samples of a PREDICTED channel block. Under PredictorType::ADAPTIVE, the
+// block's predictor comes first. At the start of a frame (warmUp), the first samples, as
+// many as the predictor order, are stored as they are; then come the 16-bit m and the
+// residuals of the others. With a per-sample m there is no m, and the parameter of each
+// residual adapts from those before it.
+void encodePredicted(ChannelBlock& ch, size_t n, bool warmUp, BitStream& bs,
+                     const EncoderConfig& config, std::vector<int>& residuals, GolombCostModel& costs,
+                     CodingStats& stats) {
+    const int32_t* x = ch.samples();
+    
+    PredictorType predictor = config.predictor;
+    if (predictor == PredictorType::ADAPTIVE) {
+        predictor = selectPredictor(ch, n, warmUp, config, residuals, costs);
+        bs.write_n_bits(static_cast<uint32_t>(predictor), PREDICTOR_BITS);
+    }
+    stats.predictorBlocks[static_cast<int>(predictor)]++;
+    
+    size_t verbatim = warmUp ? std::min(predictorOrder(predictor, ch.lpc), n) : 0;
+    for (size_t i = 0; i < verbatim; i++) {
+        bs.write_n_bits(static_cast<uint32_t>(x[i]), WARMUP_BITS);
+    }
+    
+    computeResiduals(ch, n, verbatim, predictor, residuals);
+    
+    if (config.perSampleM) {
+        PROFILE_SCOPE(ENTROPY);
+        GolombCoding golomb(1, config.negativeMode);
+        golomb.setEscape(config.maxQuotient, ESCAPE_BITS);
+        for (int residual : residuals) {
+            golomb.encodeAdaptive(residual, ch.rice, bs);
+        }
+        stats.blocks++;
+        stats.riceBlocks++;
+        return;
+    }
+    
+    unsigned int m = config.adaptiveM ? selectGolombParameter(residuals, config.riceOnly, costs) : config.fixedM;
+    PROFILE_M(m);
+    
+    PROFILE_SCOPE(ENTROPY);
+    bs.write_n_bits(m, 16);
+    
+    GolombCoding golomb(m, config.negativeMode);
+    golomb.setEscape(config.maxQuotient, ESCAPE_BITS);
+    golomb.encodeBlock(residuals, bs);
+    
+    stats.blocks++;
+    stats.riceBlocks += golomb.isRice() ? 1 : 0;
+}
+
+// Encode the n samples of one channel block (see BlockType). A block of one value is
+// CONSTANT. Otherwise it is coded as PREDICTED, or as WASTED when its samples share
+// trailing zero bits, into scratch, and kept unless VERBATIM would be no longer.
+void encodeChannelBlock(ChannelBlock& ch, size_t n, bool warmUp, BitStream& bs,
+                        const EncoderConfig& config, std::vector<int>& residuals, GolombCostModel& costs,
+                        std::vector<uint8_t>& scratch, CodingStats& stats) {
+    const int32_t* x = ch.samples();
+    
+    if (std::all_of(x, x + n, [&](int32_t v) { return v == x[0]; })) {
+        bs.write_n_bits(static_cast<uint32_t>(BlockType::CONSTANT), BLOCK_TYPE_BITS);
+        bs.write_n_bits(static_cast<uint32_t>(x[0]), WARMUP_BITS);
+        stats.constantBlocks++;
+        return;
+    }
+    
+    uint32_t ored = 0;
+    int width = 1;
+    for (size_t i = 0; i < n; i++) {
+        ored |= static_cast<uint32_t>(x[i]);
+        width = std::max(width, static_cast<int>(std::bit_width(static_cast<uint32_t>(x[i] ^ (x[i] >> 31)))) + 1);
+    }
+    int shift = std::min(std::countr_zero(ored), MAX_WASTED_BITS);
+    
+    AdaptiveRice rice = ch.rice;
+    CodingStats predictedStats;
+    uint64_t predictedBits;
+    scratch.clear();
+    {
+        MemorySink sink(scratch);
+        BitStream predicted(sink);
+        if (shift != 0) {
+            ch.shiftOut(n, shift);
+        }
+        encodePredicted(ch, n, warmUp, predicted, config, residuals, costs, predictedStats);
+        if (shift != 0) {
+            ch.shiftIn(n, shift);
+        }
+        predictedBits = predicted.tell_bits();
+        predicted.close();
+    }
+    
+    uint64_t verbatimBits = VERBATIM_WIDTH_BITS + n * width;
+    if (predictedBits + (shift != 0 ? WASTED_SHIFT_BITS : 0) >= verbatimBits) {
+        ch.rice = rice; // As the decoder leaves it
+        PROFILE_SCOPE(ENTROPY);
+        bs.write_n_bits(static_cast<uint32_t>(BlockType::VERBATIM), BLOCK_TYPE_BITS);
+        bs.write_n_bits(width, VERBATIM_WIDTH_BITS);
+        for (size_t i = 0; i < n; i++) {
+            bs.write_n_bits(static_cast<uint32_t>(x[i]), width);
+        }
+        stats.verbatimBlocks++;
+        return;
+    }
+    
+    if (shift != 0) {
+        bs.write_n_bits(static_cast<uint32_t>(BlockType::WASTED), BLOCK_TYPE_BITS);
+        bs.write_n_bits(shift, WASTED_SHIFT_BITS);
+        stats.wastedBlocks++;
+    } else {
+        bs.write_n_bits(static_cast<uint32_t>(BlockType::PREDICTED), BLOCK_TYPE_BITS);
+    }
+    PROFILE_SCOPE(BIT_IO);
+    bs.write_bits(scratch.data(), predictedBits);
+    stats += predictedStats;
+}
+
+// Decode the n samples of a PREDICTED channel block into ch.samples()
+void decodePredicted(ChannelBlock& ch, size_t n, bool warmUp, BitStream& bs,
+                     PredictorType predictor, bool perSampleM, GolombCoding& golomb) {
+    int32_t* x = ch.samples();
+    
+    if (predictor == PredictorType::ADAPTIVE) {
+        int type = static_cast<int>(bs.read_n_bits(PREDICTOR_BITS));
+        if (type >= PREDICTOR_TYPES) {
+            throw std::runtime_error("corrupt block predictor");
+        }
+        predictor = static_cast<PredictorType>(type);
+    }
+    
+    size_t verbatim = warmUp ? std::min(predictorOrder(predictor, ch.lpc), n) : 0;
+    for (size_t i = 0; i < verbatim; i++) {
+        uint32_t bits = static_cast<uint32_t>(bs.read_n_bits(WARMUP_BITS));
+        x[i] = static_cast<int32_t>(bits << (32 - WARMUP_BITS)) >> (32 - WARMUP_BITS); // Sign extend
+    }
+    
+    // The residuals are read into x, then the predictions added; a prediction only looks
+    // at the samples before its own
+    {
+        PROFILE_SCOPE(ENTROPY);
+        if (perSampleM) {
+            for (size_t i = verbatim; i < n; i++) {
+                x[i] = golomb.decodeAdaptive(ch.rice, bs);
+            }
+        } else {
+            golomb.setM(static_cast<unsigned int>(bs.read_n_bits(16)));
+            PROFILE_M(golomb.getM());
+            golomb.decodeBlock(std::span<int>(x + verbatim, n - verbatim), bs);
+        }
+    }
+    
+    PROFILE_SCOPE(PREDICTION);
+    for (size_t i = verbatim; i < n; i++) {
+        x[i] += predict(x + i, std::min(MAX_HISTORY, ch.history + i), predictor, ch.lpc);
+    }
+}
+
+// Decode the n samples of one channel block into ch.samples(); before version 3 every
+// block is PREDICTED
+void decodeChannelBlock(ChannelBlock& ch, size_t n, bool warmUp, BitStream& bs,
+                        const AgolHeader& header, GolombCoding& golomb) {
+    int32_t* x = ch.samples();
+    
+    BlockType type = BlockType::PREDICTED;
+    if (header.version >= 3) {
+        type = static_cast<BlockType>(bs.read_n_bits(BLOCK_TYPE_BITS));
+    }
+    
+    switch (type) {
+        case BlockType::CONSTANT: {
+            uint32_t bits = static_cast<uint32_t>(bs.read_n_bits(WARMUP_BITS));
+            std::fill_n(x, n, static_cast<int32_t>(bits << (32 - WARMUP_BITS)) >> (32 - WARMUP_BITS));
+            break;
+        }
+        
+        case BlockType::VERBATIM: {
+            PROFILE_SCOPE(ENTROPY);
+            int width = static_cast<int>(bs.read_n_bits(VERBATIM_WIDTH_BITS));
+            if (width == 0) {
+                throw std::runtime_error("corrupt verbatim block");
+            }
+            for (size_t i = 0; i < n; i++) {
+                uint32_t bits = static_cast<uint32_t>(bs.read_n_bits(width));
+                x[i] = static_cast<int32_t>(bits << (32 - width)) >> (32 - width); // Sign extend
+            }
+            break;
+        }
+        
+        case BlockType::WASTED: {
+            int shift = static_cast<int>(bs.read_n_bits(WASTED_SHIFT_BITS));
+            ch.shiftOut(0, shift);
+            decodePredicted(ch, n, warmUp, bs, header.predictor, header.perSampleM, golomb);
+            ch.shiftIn(n, shift);
+            break;
+        }
+        
+        default:
+            decodePredicted(ch, n, warmUp, bs, header.predictor, header.perSampleM, golomb);
+            break;
+    }
+}
+
+// The trial encodes of a node of the variable block-size partition (see encodeNode), kept
+// from one frame to the next, one per depth
+struct TrialNode {
+    ChannelBlock whole[2], halves[2];
+    std::vector<uint8_t> wholeBytes, halvesBytes;
+    
+    explicit TrialNode(size_t maxBlock)
+        : whole{ChannelBlock(maxBlock), ChannelBlock(maxBlock)},
+          halves{ChannelBlock(maxBlock), ChannelBlock(maxBlock)} {}
+};
+
+// Codes independent frames (see INDEPENDENT_FRAMES), one at a time: the frame is put in
+// pcm, and encode() leaves it in bytes. All buffers are kept for the next frame.
+struct FrameEncoder {
+    EncoderConfig config;
+    int channels = 0;
+    size_t frameSize;
+    std::vector<int16_t> pcm;
+    size_t n = 0;
+    std::vector<uint8_t> bytes;
+    CodingStats stats;
+    
+    ChannelBlock ch[2];
+    std::vector<int32_t> split[2];
+    std::vector<int> residuals;
+    GolombCostModel costs;
+    std::vector<uint8_t> scratch;
+    std::vector<int32_t> stereoScratch;     // Of selectStereoMode
+    std::vector<TrialNode> trials;
+    
+    FrameEncoder(const EncoderConfig& config, size_t frameSize)
+        : config(config), frameSize(frameSize), costs(config.negativeMode) {
+        size_t maxBlock = config.blockSize != 0 ? config.blockSize : frameSize;
+        ch[0] = ch[1] = ChannelBlock(maxBlock);
+        if (config.stereoMode == StereoMode::ADAPTIVE) {
+            stereoScratch.reserve(4 * (maxBlock + 4));
+        }
+        if (config.blockSize == 0) {
+            trials.assign(std::bit_width(frameSize / MIN_BLOCK_SIZE), TrialNode(maxBlock)); // One per depth that can split
+        }
+    }
+    
+    // Encode the n frames in pcm
+    void encode() {
+        bytes.clear();
+        stats = CodingStats();
+        MemorySink sink(bytes);
+        BitStream bs(sink);
+        
+        for (int c = 0; c < channels; c++) {
+            ch[c].restart();
+        }
+        
+        // Under StereoMode::ADAPTIVE the filters are fitted to mid and side
+        StereoMode frameMode = config.stereoMode == StereoMode::ADAPTIVE ? StereoMode::MID_SIDE : config.stereoMode;
+        if (usesLpc(config.predictor)) {
+            split[0].resize(n);
+            split[1].resize(n);
+            {
+                PROFILE_SCOPE(DECORRELATION);
+                splitChannels(pcm.data(), n, channels, frameMode, split[0].data(), split[1].data());
+            }
+            PROFILE_SCOPE(PREDICTION);
+            for (int c = 0; c < channels; c++) {
+                ch[c].lpc = computeLpc(split[c].data(), n, config.lpcOrder);
+                ch[c].lpc.write(bs);
+            }
+        }
+        
+        if (config.blockSize == 0) {
+            encodeNode(ch, 0, frameSize, 0, bs, stats);
+        } else {
+            for (size_t pos = 0; pos < n; pos += config.blockSize) {
+                encodeBlock(ch, pos, std::min<size_t>(config.blockSize, n - pos), bs, stats);
+            }
+        }
+        
+        bs.close();
+    }
+    
+    // The len frames from pos as one block: its stereo mode (StereoMode::ADAPTIVE), then
+    // each channel block
+    void encodeBlock(ChannelBlock ch[2], size_t pos, size_t len, BitStream& bs, CodingStats& stats) {
+        const int16_t* frames = pcm.data();
+        StereoMode mode = config.stereoMode;
+        {
+            PROFILE_SCOPE(DECORRELATION);
+            if (channels == 2 && mode == StereoMode::ADAPTIVE) {
+                mode = selectStereoMode(frames + pos * channels, len, ch[0].history, stereoScratch);
+                bs.write_n_bits(static_cast<uint32_t>(mode), STEREO_BITS);
+                stats.stereoBlocks[static_cast<int>(mode)]++;
+                restoreHistory(ch, frames + pos * channels, channels, mode);
+            }
+            splitChannels(frames + pos * channels, len, channels, mode, ch[0].samples(), ch[1].samples());
+        }
+        
+        for (int c = 0; c < channels; c++) {
+            encodeChannelBlock(ch[c], len, ch[c].history == 0, bs, config, residuals, costs, scratch, stats);
+            ch[c].carry(len);
+        }
+        stats.frameBlocks++;
+    }
+    
+    // The node of size frames from pos, depth halvings below the frame, of the variable
+    // block-size partition. Above MIN_BLOCK_SIZE, a bit tells whether it is split in two
+    // halves; both ways are coded, from the same state, and the shorter is kept.
+    void encodeNode(ChannelBlock ch[2], size_t pos, size_t size, size_t depth, BitStream& bs, CodingStats& stats) {
+        if (pos >= n) {
+            return;
+        }
+        size_t len = std::min(size, n - pos);
+        if (size <= MIN_BLOCK_SIZE) {
+            encodeBlock(ch, pos, len, bs, stats);
+            return;
+        }
+        
+        // The trials start from the state of ch; the blocks are swapped, not copied, as
+        // all have the same size
+        TrialNode& trial = trials[depth];
+        for (int c = 0; c < channels; c++) {
+            trial.whole[c].resumeFrom(ch[c]);
+            trial.halves[c].resumeFrom(ch[c]);
+        }
+        trial.wholeBytes.clear();
+        trial.halvesBytes.clear();
+        CodingStats wholeStats, halvesStats;
+        uint64_t wholeBits, halvesBits;
+        {
+            MemorySink sink(trial.wholeBytes);
+            BitStream trialBs(sink);
+            encodeBlock(trial.whole, pos, len, trialBs, wholeStats);
+            wholeBits = trialBs.tell_bits();
+            trialBs.close();
+        }
+        {
+            MemorySink sink(trial.halvesBytes);
+            BitStream trialBs(sink);
+            encodeNode(trial.halves, pos, size / 2, depth + 1, trialBs, halvesStats);
+            encodeNode(trial.halves, pos + size / 2, size / 2, depth + 1, trialBs, halvesStats);
+            halvesBits = trialBs.tell_bits();
+            trialBs.close();
+        }
+        
+        PROFILE_SCOPE(BIT_IO);
+        bool split = halvesBits < wholeBits;
+        bs.write_bit(split);
+        bs.write_bits(split ? trial.halvesBytes.data() : trial.wholeBytes.data(), split ? halvesBits : wholeBits);
+        stats += split ? halvesStats : wholeStats;
+        for (int c = 0; c < channels; c++) {
+            std::swap(ch[c], split ? trial.halves[c] : trial.whole[c]);
+        }
+    }
+};
+
+// Stereo mode of the next block: sent before it under StereoMode::ADAPTIVE
+StereoMode readStereoMode(BitStream& bs, const AgolHeader& header) {
+    if (header.channels != 2 || header.stereoMode != StereoMode::ADAPTIVE) {
+        return header.stereoMode;
+    }
+    return static_cast<StereoMode>(bs.read_n_bits(STEREO_BITS));
+}
+
+// Decode the len frames from pos of a frame, as one block, into frames
+void decodeBlock(BitStream& bs, size_t pos, size_t len, const AgolHeader& header, ChannelBlock ch[2],
+                 GolombCoding& golomb, int16_t* frames) {
+    StereoMode mode = readStereoMode(bs, header);
+    if (header.channels == 2 && header.stereoMode == StereoMode::ADAPTIVE) {
+        PROFILE_SCOPE(DECORRELATION);
+        restoreHistory(ch, frames + pos * header.channels, header.channels, mode);
+    }
+    for (int c = 0; c < header.channels; c++) {
+        decodeChannelBlock(ch[c], len, ch[c].history == 0, bs, header, golomb);
+    }
+    PROFILE_SCOPE(DECORRELATION);
+    joinChannels(ch[0].samples(), ch[1].samples(), len, header.channels, mode,
+                 frames + pos * header.channels);
+    for (int c = 0; c < header.channels; c++) {
+        ch[c].carry(len);
+    }
+}
+
+// Decode the node of size frames from pos of a variable block-size partition (of a frame
+// of n frames)
+void decodeNode(BitStream& bs, size_t pos, size_t size, size_t n, const AgolHeader& header,
+                ChannelBlock ch[2], GolombCoding& golomb, int16_t* frames) {
+    if (pos >= n) {
+        return;
+    }
+    if (size > MIN_BLOCK_SIZE && bs.read_bit() == 1) {
+        decodeNode(bs, pos, size / 2, n, header, ch, golomb, frames);
+        decodeNode(bs, pos + size / 2, size / 2, n, header, ch, golomb, frames);
+        return;
+    }
+    decodeBlock(bs, pos, std::min(size, n - pos), header, ch, golomb, frames);
+}
+
+// Decodes independent frames, one at a time, into pcm; the buffers are kept for the next
+// frame
+struct FrameDecoder {
+    std::vector<int16_t> pcm;
+    ChannelBlock ch[2];
+    
+    // Decode a frame of n interleaved frames; bs must be at its first byte
+    void decode(BitStream& bs, size_t n, const AgolHeader& header) {
+        GolombCoding golomb(1, header.negativeMode);
+        golomb.setEscape(header.maxQuotient, ESCAPE_BITS);
+        
+        size_t maxBlock = header.blockSize != 0 ? header.blockSize : header.frameSize;
+        pcm.resize(n * header.channels);
+        for (int c = 0; c < header.channels; c++) {
+            ch[c].restart();
+            if (ch[c].data.size() < MAX_HISTORY + maxBlock) {
+                ch[c].data.resize(MAX_HISTORY + maxBlock);
+            }
+            if (usesLpc(header.predictor)) {
+                ch[c].lpc.read(bs);
+            }
+        }
+        
+        int16_t* frames = pcm.data();
+        if (header.blockSize == 0) {
+            decodeNode(bs, 0, header.frameSize, n, header, ch, golomb, frames);
+        } else {
+            for (size_t pos = 0; pos < n; pos += header.blockSize) {
+                decodeBlock(bs, pos, std::min<size_t>(header.blockSize, n - pos), header, ch, golomb, frames);
+            }
+        }
+    }
+};
+
+Encoder::Encoder(const EncoderConfig& config, unsigned int threads) : config(config) {
+    if (config.blockSize != 0 && (config.blockSize < MIN_FIXED_BLOCK_SIZE || config.blockSize > MAX_BLOCK_SIZE)) {
+        throw std::invalid_argument("invalid block size");
+    }
+    fileHeader.predictor = config.predictor;
+    fileHeader.stereoMode = config.stereoMode;
+    fileHeader.adaptiveM = config.adaptiveM;
+    fileHeader.perSampleM = config.perSampleM;
+    fileHeader.fixedM = config.fixedM;
+    fileHeader.negativeMode = config.negativeMode;
+    fileHeader.maxQuotient = config.maxQuotient;
+    // Fixed blocks: as many whole ones as fit in FRAME_SIZE, at least one
+    fileHeader.blockSize = config.blockSize;
+    fileHeader.frameSize = config.blockSize == 0
+        ? FRAME_SIZE : config.blockSize * std::max<unsigned int>(1, FRAME_SIZE / config.blockSize);
+    
+    if (threads > 1) {
+        pool = std::make_unique<ThreadPool>(threads);
+    }
+    size_t count = pool ? 2 * pool->size() : 1;
+    for (size_t i = 0; i < count; i++) {
+        slots.push_back(std::make_unique<FrameEncoder>(config, fileHeader.frameSize));
+    }
+}
+
+Encoder::~Encoder() = default;
+
+void Encoder::begin(BitStream& bs, int channels, int sampleRate, int64_t frames) {
+    if (channels != 1 && channels != 2) {
+        throw std::invalid_argument("only mono and stereo audio supported");
+    }
+    // Left over from a file that failed part way
+    for (std::future<void>& job : pending) {
+        job.wait();
+    }
+    pending.clear();
+    
+    fileHeader.channels = channels;
+    fileHeader.sampleRate = sampleRate;
+    fileHeader.frames = frames;
+    writeHeader(bs, fileHeader);
+    
+    out = &bs;
+    totals = CodingStats();
+    frameBytes.clear();
+    frameBytes.reserve(fileHeader.numFrames());
+    remaining = frames;
+    next = oldest = filled = 0;
+    for (std::unique_ptr<FrameEncoder>& frame : slots) {
+        frame->channels = channels;
+        frame->pcm.resize(static_cast<size_t>(fileHeader.frameSize) * channels);
+    }
+}
+
+void Encoder::write(const int16_t* pcm, size_t n) {
+    if (static_cast<int64_t>(n) > remaining) {
+        throw std::invalid_argument("more frames than the file was begun with");
+    }
+    int channels = fileHeader.channels;
+    while (n > 0) {
+        FrameEncoder& frame = *slots[next];
+        size_t length = static_cast<size_t>(std::min<int64_t>(fileHeader.frameSize, filled + remaining));
+        size_t count = std::min(n, length - filled);
+        std::copy_n(pcm, count * channels, frame.pcm.data() + filled * channels);
+        pcm += count * channels;
+        n -= count;
+        filled += count;
+        remaining -= count;
+        if (filled == length) {
+            frame.n = length;
+            filled = 0;
+            submit();
+        }
+    }
+}
+
+void Encoder::finish() {
+    if (remaining != 0) {
+        throw std::runtime_error("fewer frames than the file was begun with");
+    }
+    while (!pending.empty()) {
+        writeOldest();
+    }
+    PROFILE_SCOPE(BIT_IO);
+    for (uint32_t size : frameBytes) {
+        out->write_n_bits(size, 32);
+    }
+    out = nullptr;
+}
+
+void Encoder::encode(const int16_t* pcm, int64_t frames, int channels, int sampleRate, std::vector<uint8_t>& bytes) {
+    MemorySink sink(bytes);
+    BitStream bs(sink);
+    begin(bs, channels, sampleRate, frames);
+    write(pcm, static_cast<size_t>(frames));
+    finish();
+    bs.close();
+}
+
+// Codes the frame in the slot just filled: at once without a pool, where there is a single
+// slot, or else on the pool, writing out the oldest frame first if every slot is taken
+void Encoder::submit() {
+    FrameEncoder* frame = slots[next].get();
+    next = (next + 1) % slots.size();
+    if (!pool) {
+        frame->encode();
+        pending.push_back(std::future<void>()); // Nothing to wait for
+        writeOldest();
+        return;
+    }
+    pending.push_back(pool->submit([frame] { frame->encode(); }));
+    if (pending.size() >= slots.size()) {
+        writeOldest();
+    }
+}
+
+void Encoder::writeOldest() {
+    if (pending.front().valid()) {
+        pending.front().get();
+    }
+    pending.pop_front();
+    const FrameEncoder& frame = *slots[oldest];
+    oldest = (oldest + 1) % slots.size();
+    PROFILE_SCOPE(BIT_IO);
+    out->write_bytes(frame.bytes.data(), frame.bytes.size());
+    frameBytes.push_back(static_cast<uint32_t>(frame.bytes.size()));
+    totals += frame.stats;
+}
+
+Decoder::Decoder(unsigned int threads) {
+    if (threads > 1) {
+        pool = std::make_unique<ThreadPool>(threads);
+    }
+    size_t count = pool ? 2 * pool->size() : 1;
+    for (size_t i = 0; i < count; i++) {
+        slots.push_back(std::make_unique<FrameDecoder>());
+    }
+}
+
+Decoder::~Decoder() = default;
+
+const AgolHeader& Decoder::open(BitStream& bs) {
+    fileHeader = AgolHeader();
+    readHeader(bs, fileHeader);
+    headerSize = static_cast<size_t>(bs.tell_bits() / 8);
+    return fileHeader;
+}
+
+// Frames are decoded as they arrive, and each is passed on as soon as it is, less the part
+// outside the range
+void Decoder::decode(BitStream& bs, int64_t first, int64_t last, const FrameWriter& write) {
+    const AgolHeader& header = fileHeader;
+    int channels = header.channels;
+    int64_t frames = header.frames;
+    last = std::min(last, frames);
+    
+    // The part of the n frames from pos at pcm that falls inside [first, last)
+    auto writeRange = [&](const int16_t* pcm, int64_t pos, size_t n) {
+        int64_t from = std::max(pos, first);
+        int64_t to = std::min<int64_t>(pos + n, last);
+        if (from < to) {
+            write(pcm + (from - pos) * channels, static_cast<size_t>(to - from));
+        }
+    };
+    
+    if ((header.layout & INDEPENDENT_FRAMES) != 0) {
+        FrameDecoder& frame = *slots[0];
+        for (int64_t pos = 0; pos < last; pos += header.frameSize) {
+            size_t n = static_cast<size_t>(std::min<int64_t>(header.frameSize, frames - pos));
+            bs.skip_bits((8 - bs.tell_bits() % 8) % 8); // Frames start on a byte boundary
+            frame.decode(bs, n, header);
+            writeRange(frame.pcm.data(), pos, n);
+        }
+        return;
+    }
+    
+    // Written by earlier versions: one predictor history over the whole stream
+    GolombCoding golomb(1, header.negativeMode);
+    golomb.setEscape(header.maxQuotient, ESCAPE_BITS);
+    ChannelBlock ch[2];
+    std::vector<int16_t> buffer(BLOCK_SIZE * channels);
+    
+    if (channels == 1 || (header.layout & INTERLEAVED_BLOCKS) != 0) {
+        for (int64_t pos = 0; pos < last; pos += BLOCK_SIZE) {
+            size_t n = static_cast<size_t>(std::min<int64_t>(BLOCK_SIZE, frames - pos));
+            StereoMode mode = readStereoMode(bs, header);
+            for (int c = 0; c < channels; c++) {
+                decodeChannelBlock(ch[c], n, false, bs, header, golomb);
+            }
+            joinChannels(ch[0].samples(), ch[1].samples(), n, channels, mode, buffer.data());
+            writeRange(buffer.data(), pos, n);
+            for (int c = 0; c < channels; c++) {
+                ch[c].carry(n);
+            }
+        }
+    } else {
+        // All of the first channel, then the second, so the first has to be kept until
+        // the second is decoded
+        std::vector<int32_t> firstChannel(frames);
+        for (int64_t pos = 0; pos < frames; pos += BLOCK_SIZE) {
+            size_t n = static_cast<size_t>(std::min<int64_t>(BLOCK_SIZE, frames - pos));
+            decodeChannelBlock(ch[0], n, false, bs, header, golomb);
+            std::copy_n(ch[0].samples(), n, firstChannel.data() + pos);
+            ch[0].carry(n);
+        }
+        for (int64_t pos = 0; pos < last; pos += BLOCK_SIZE) {
+            size_t n = static_cast<size_t>(std::min<int64_t>(BLOCK_SIZE, frames - pos));
+            decodeChannelBlock(ch[1], n, false, bs, header, golomb);
+            joinChannels(firstChannel.data() + pos, ch[1].samples(), n, channels, header.stereoMode, buffer.data());
+            writeRange(buffer.data(), pos, n);
+            ch[1].carry(n);
+        }
+    }
+}
+
+// Version 2 files and later: the frames in the range are located through the seek table
+// and decoded in the slots, in turn (on the pool, if there is one), and passed on in order
+void Decoder::decode(const uint8_t* data, size_t size, int64_t first, int64_t last, const FrameWriter& write) {
+    const AgolHeader& header = fileHeader;
+    if (size < headerSize) {
+        throw std::runtime_error("corrupt AGOL header");
+    }
+    if (header.version < 2) {
+        MemorySource source(data + headerSize, size - headerSize);
+        BitStream bs(source);
+        decode(bs, first, last, write);
+        return;
+    }
+    
+    size_t numFrames = header.numFrames();
+    if ((size - headerSize) / sizeof(uint32_t) < numFrames) {
+        throw std::runtime_error("corrupt seek table");
+    }
+    size_t tableOffset = size - numFrames * sizeof(uint32_t);
+    std::vector<size_t> offsets(numFrames + 1, headerSize);
+    {
+        PROFILE_SCOPE(BIT_IO);
+        std::vector<uint32_t> frameBytes(numFrames);
+        if (header.version >= 5) {
+            MemorySource source(data + tableOffset, numFrames * sizeof(uint32_t));
+            BitStream table(source);
+            for (uint32_t& bytes : frameBytes) {
+                bytes = static_cast<uint32_t>(table.read_n_bits(32));
+            }
+        } else {
+            std::memcpy(frameBytes.data(), data + tableOffset, numFrames * sizeof(uint32_t));
+        }
+        for (size_t f = 0; f < numFrames; f++) {
+            offsets[f + 1] = offsets[f] + frameBytes[f];
+        }
+    }
+    if (offsets[numFrames] != tableOffset) {
+        throw std::runtime_error("corrupt seek table");
+    }
+    
+    last = std::min(last, header.frames);
+    if (first >= last) {
+        return;
+    }
+    
+    std::deque<std::pair<std::future<void>, int64_t>> pending;  // With the frame's first
+    size_t next = 0, oldest = 0;
+    
+    // The part of the oldest frame that falls inside [first, last)
+    auto writeOldest = [&] {
+        if (pending.front().first.valid()) {
+            pending.front().first.get();
+        }
+        int64_t pos = pending.front().second;
+        pending.pop_front();
+        const std::vector<int16_t>& pcm = slots[oldest]->pcm;
+        oldest = (oldest + 1) % slots.size();
+        int64_t from = std::max(pos, first);
+        int64_t to = std::min<int64_t>(pos + header.frameSize, last);
+        write(pcm.data() + (from - pos) * header.channels, static_cast<size_t>(to - from));
+    };
+    
+    size_t lastFrame = static_cast<size_t>((last + header.frameSize - 1) / header.frameSize);
+    try {
+        for (size_t f = static_cast<size_t>(first / header.frameSize); f < lastFrame; f++) {
+            int64_t pos = static_cast<int64_t>(f) * header.frameSize;
+            size_t n = static_cast<size_t>(std::min<int64_t>(header.frameSize, header.frames - pos));
+            FrameDecoder* frame = slots[next].get();
+            next = (next + 1) % slots.size();
+            
+            auto job = [frame, frameData = data + offsets[f], frameSize = offsets[f + 1] - offsets[f], n, &header] {
+                MemorySource source(frameData, frameSize);
+                BitStream bs(source);
+                frame->decode(bs, n, header);
+            };
+            if (!pool) {
+                job();
+                pending.emplace_back(std::future<void>(), pos);
+            } else {
+                pending.emplace_back(pool->submit(job), pos);
+            }
+            if (pending.size() >= slots.size()) {
+                writeOldest();
+            }
+        }
+        while (!pending.empty()) {
+            writeOldest();
+        }
+    } catch (...) {
+        // The slots may still be in use
+        for (auto& job : pending) {
+            if (job.first.valid()) {
+                job.first.wait();
+            }
+        }
+        throw;
+    }
+}
+
+const AgolHeader& Decoder::decode(const uint8_t* data, size_t size, std::vector<int16_t>& pcm) {
+    {
+        MemorySource source(data, size);
+        BitStream bs(source);
+        open(bs);
+    }
+    
+    // The frames the header claims must have their seek table entries in the data before
+    // the samples get their memory; version 1 has no table, and grows as it decodes
+    pcm.clear();
+    if (fileHeader.version >= 2) {
+        if (size < headerSize || (size - headerSize) / sizeof(uint32_t) < fileHeader.numFrames()) {
+            throw std::runtime_error("corrupt seek table");
+        }
+        pcm.reserve(static_cast<size_t>(fileHeader.frames) * fileHeader.channels);
+    }
+    decode(data, size, 0, fileHeader.frames, [&](const int16_t* frames, size_t n) {
+        pcm.insert(pcm.end(), frames, frames + n * fileHeader.channels);
+    });
+    return fileHeader;
+}
+
+}
@@ -0,0 +1,228 @@
+#ifndef AGOL_H
+#define AGOL_H
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+#include "Golomb.h"
+#include "bit_stream/src/bit_stream.h"
+
+class ThreadPool;
+
+// Lossless audio coding into AGOL files, for use in-process: Encoder and Decoder work on
+// BitStreams (any ByteSource or ByteSink, see byte_io.h) or on memory buffers, and keep
+// their buffers from one file to the next. audio_codec is a command line on top of them.
+namespace agol {
+
+// Predictor types
+enum class PredictorType {
+    ORDER_1 = 0,
+    ORDER_2 = 1,
+    ORDER_3 = 2,
+    LPC = 3,            // Coefficients per frame and channel (see LpcFilter)
+    ORDER_0 = 4,
+    ORDER_4 = 5,
+    ADAPTIVE = 6        // Chosen per block among the others (see selectPredictor)
+};
+
+const int PREDICTOR_TYPES = 6;  // Those that can be sent under ADAPTIVE
+
+// Stereo modes: the two channels coded, (left, right), (mid, side), (left, side) or
+// (right, side), with side = left - right
+enum class StereoMode {
+    INDEPENDENT = 0,
+    MID_SIDE = 1,
+    LEFT_SIDE = 2,
+    RIGHT_SIDE = 3,
+    ADAPTIVE = 4        // Chosen per block among the others (see selectStereoMode)
+};
+
+const int STEREO_MODES = 4;     // Those that can be sent under ADAPTIVE
+
+// Samples are coded in blocks of BLOCK_SIZE (by default; -b), and blocks are grouped into
+// frames of about FRAME_SIZE that code and decode on their own (see INDEPENDENT_FRAMES)
+const size_t BLOCK_SIZE = 1024;
+const size_t FRAME_SIZE = 4 * BLOCK_SIZE;
+
+// Fixed block sizes allowed (-b), and the smallest block of a variable partition (-b 0)
+const size_t MIN_FIXED_BLOCK_SIZE = 16;
+const size_t MAX_BLOCK_SIZE = 16384;
+const size_t MIN_BLOCK_SIZE = 256;
+
+// Default highest LPC order (-l); the order of each frame is chosen up to it
+const int LPC_ORDER = 12;
+
+// Width of an escaped code (-q): with the 17-bit side channel, residuals lie in
+// [-131070, 131070], so their mapped values fit in 18 bits
+const int ESCAPE_BITS = 18;
+
+// Layout flags, kept in the stereo field of version 1 headers (version 2 always has both).
+// INTERLEAVED_BLOCKS: the two channels alternate block by block (without it, all of the
+// first channel comes first). INDEPENDENT_FRAMES: the stream is a sequence of frames of
+// FRAME_SIZE frames (version 2: the header's frame size), each starting on a byte boundary
+// and with its first samples (as many as the predictor order) stored verbatim, so that
+// frames code and decode on their own. With the LPC predictor, a frame starts with the
+// filter of each channel (see LpcFilter::write), as it does under PredictorType::ADAPTIVE,
+// where the warm-up is that of each channel's first predictor.
+const int INTERLEAVED_BLOCKS = 0x100;
+const int INDEPENDENT_FRAMES = 0x200;
+
+// Version 2 files always use both layout flags and end with a seek table: the size in
+// bytes (uint32) of each frame, so that any frame can be found without decoding the others.
+// Version 3 adds a BlockType before each channel block. Version 4 adds the block size to
+// the header; 0 there means a variable one: each frame, of a power of two frames, is
+// partitioned recursively (see decodeNode). Version 5 writes the header and the seek
+// table big-endian; earlier versions wrote them in the writer's native byte order.
+const int AGOL_VERSION = 5;
+
+// Fields of the AGOL header
+struct AgolHeader {
+    int version = AGOL_VERSION;
+    int channels = 0;
+    int sampleRate = 0;
+    int64_t frames = 0;
+    PredictorType predictor = PredictorType::ORDER_2;
+    StereoMode stereoMode = StereoMode::MID_SIDE;
+    int layout = INTERLEAVED_BLOCKS | INDEPENDENT_FRAMES;
+    bool adaptiveM = true;
+    bool perSampleM = false;
+    unsigned int fixedM = 16;
+    GolombCoding::NegativeMode negativeMode = GolombCoding::INTERLEAVED;
+    unsigned int maxQuotient = 0;
+    unsigned int frameSize = FRAME_SIZE;
+    unsigned int blockSize = BLOCK_SIZE;
+
+    size_t numFrames() const { return static_cast<size_t>((frames + frameSize - 1) / frameSize); }
+};
+
+// Encoder settings: the audio_codec options, with their defaults
+struct EncoderConfig {
+    PredictorType predictor = PredictorType::ORDER_2;
+    StereoMode stereoMode = StereoMode::MID_SIDE;
+    bool adaptiveM = true;
+    bool perSampleM = false;
+    unsigned int fixedM = 16;
+    bool riceOnly = false;
+    GolombCoding::NegativeMode negativeMode = GolombCoding::INTERLEAVED;
+    unsigned int maxQuotient = 0;
+    int lpcOrder = LPC_ORDER;
+    unsigned int blockSize = BLOCK_SIZE;  // 0: variable, chosen per frame
+};
+
+// Per-file coding counters, reported with the compression statistics
+struct CodingStats {
+    size_t blocks = 0;
+    size_t riceBlocks = 0;   // blocks whose m is a power of two (shift/mask path)
+    std::array<size_t, PREDICTOR_TYPES> predictorBlocks{};
+    std::array<size_t, STEREO_MODES> stereoBlocks{};
+    size_t constantBlocks = 0;
+    size_t verbatimBlocks = 0;
+    size_t wastedBlocks = 0;
+    size_t frameBlocks = 0;  // blocks the frames were partitioned into, all channels together
+
+    CodingStats& operator+=(const CodingStats& other) {
+        blocks += other.blocks;
+        riceBlocks += other.riceBlocks;
+        for (int p = 0; p < PREDICTOR_TYPES; p++) {
+            predictorBlocks[p] += other.predictorBlocks[p];
+        }
+        for (int m = 0; m < STEREO_MODES; m++) {
+            stereoBlocks[m] += other.stereoBlocks[m];
+        }
+        constantBlocks += other.constantBlocks;
+        verbatimBlocks += other.verbatimBlocks;
+        wastedBlocks += other.wastedBlocks;
+        frameBlocks += other.frameBlocks;
+        return *this;
+    }
+};
+
+struct FrameEncoder;
+struct FrameDecoder;
+
+// Decoded frames, interleaved, handed over in order: n of them at pcm
+using FrameWriter = std::function<void(const int16_t* pcm, size_t n)>;
+
+// Encodes 16-bit PCM (mono or stereo, interleaved) into AGOL files. A file is started with
+// begin(), given its frames with write(), as many at a time as convenient, and ended with
+// finish(); or coded from memory in one call with encode(). With threads > 1, frames are
+// coded on a pool, at most two per thread in flight.
+class Encoder {
+public:
+    explicit Encoder(const EncoderConfig& config = EncoderConfig(), unsigned int threads = 1);
+    ~Encoder();
+
+    Encoder(const Encoder&) = delete;
+    Encoder& operator=(const Encoder&) = delete;
+
+    // Writes the header of a file of frames frames to bs, which must stay open until finish()
+    void begin(BitStream& bs, int channels, int sampleRate, int64_t frames);
+    void write(const int16_t* pcm, size_t n);
+    // Writes the last frames and the seek table; bs is not closed
+    void finish();
+
+    // A whole file: the frames at pcm, appended to bytes
+    void encode(const int16_t* pcm, int64_t frames, int channels, int sampleRate, std::vector<uint8_t>& bytes);
+
+    const AgolHeader& header() const { return fileHeader; }
+    const CodingStats& stats() const { return totals; }    // Of the current (or last) file
+
+private:
+    void submit();
+    void writeOldest();
+
+    EncoderConfig config;
+    AgolHeader fileHeader;
+    CodingStats totals;
+    BitStream* out = nullptr;
+    std::vector<uint32_t> frameBytes;   // The seek table
+    int64_t remaining = 0;              // Frames not yet given to write()
+
+    // Frames are coded in slots, in turn; pending holds those on the pool, oldest first
+    std::vector<std::unique_ptr<FrameEncoder>> slots;
+    size_t next = 0;                    // Slot being filled
+    size_t filled = 0;                  // Frames in it
+    size_t oldest = 0;
+    std::deque<std::future<void>> pending;
+    std::unique_ptr<ThreadPool> pool;   // Last, so that its jobs end before the slots go
+};
+
+// Decodes AGOL files of any version. open() reads the header; decode() then passes the
+// frames in a range to a FrameWriter. From memory, version 2 files and later are decoded
+// through the seek table, on a pool when threads > 1; from a BitStream (e.g. a pipe), as
+// they arrive.
+class Decoder {
+public:
+    explicit Decoder(unsigned int threads = 1);
+    ~Decoder();
+
+    Decoder(const Decoder&) = delete;
+    Decoder& operator=(const Decoder&) = delete;
+
+    // Reads the header at the start of bs; throws std::runtime_error if it is not a valid one
+    const AgolHeader& open(BitStream& bs);
+
+    // Frames [first, last), once open() has read the header from bs, or from the start of
+    // the size bytes at data (the whole file)
+    void decode(BitStream& bs, int64_t first, int64_t last, const FrameWriter& write);
+    void decode(const uint8_t* data, size_t size, int64_t first, int64_t last, const FrameWriter& write);
+
+    // A whole file held in memory, into pcm (resized to fit)
+    const AgolHeader& decode(const uint8_t* data, size_t size, std::vector<int16_t>& pcm);
+
+    const AgolHeader& header() const { return fileHeader; }
+
+private:
+    AgolHeader fileHeader;
+    size_t headerSize = 0;
+    std::vector<std::unique_ptr<FrameDecoder>> slots;
+    std::unique_ptr<ThreadPool> pool;
+};
+
+}
+
+#endif
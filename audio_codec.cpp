@@ -1,5 +1,8 @@
-#include "Golomb.h"
-#include "bit_stream/src/bit_stream.h"
+#include "agol.h"
+#include "batch.h"
+#include "lpc.h"
+#include "profile.h"
+#include "thread_pool.h"
 #include <sndfile.hh>
 #include <iostream>
 #include <string>
@@ -7,200 +10,152 @@
 #include <vector>
 #include <cmath>
 #include <algorithm>
-#include <numeric>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
 
-// Predictor types
-enum class PredictorType {
-    ORDER_1 = 0,
-    ORDER_2 = 1,
-    ORDER_3 = 2
-};
+using namespace agol;
 
-// Stereo modes
-enum class StereoMode {
-    INDEPENDENT = 0,
-    MID_SIDE = 1
-};
+// Progress and statistics; sent to stderr when the AGOL or WAV side is stdout
+static std::ostream* info = &std::cout;
 
-// Predict next sample based on previous samples
-int16_t predict(const std::vector<int16_t>& samples, size_t index, PredictorType predictor) {
-    if (index == 0) return 0;
-    
-    auto clamp = [](int32_t val) { 
-        return static_cast<int16_t>(std::clamp(val, -32768, 32767)); 
-    };
-    
-    switch (predictor) {
-        case PredictorType::ORDER_1:
-            return samples[index - 1];
-            
-        case PredictorType::ORDER_2:
-            if (index < 2) return samples[index - 1];
-            return clamp(2 * samples[index - 1] - samples[index - 2]);
-            
-        case PredictorType::ORDER_3:
-            if (index < 2) return samples[index - 1];
-            if (index < 3) return clamp(2 * samples[index - 1] - samples[index - 2]);
-            return clamp(3 * samples[index - 1] - 3 * samples[index - 2] + samples[index - 3]);
-            
-        default:
-            return 0;
-    }
-}
-
-// Estimate optimal Golomb parameter m for a block of residuals
-// For geometric distribution: optimal m ≈ ceil(-1/log2(p)) where p = mean/(mean+1)
-unsigned int estimateGolombParameter(const std::vector<int>& residuals) {
-    if (residuals.empty()) return 1;
-    
-    double mean = std::accumulate(residuals.begin(), residuals.end(), 0.0,
-                                  [](double sum, int r) { return sum + std::abs(r); }) 
-                  / residuals.size();
-    
-    if (mean < 0.5) return 1;
-    
-    // Optimal m for geometric distribution: m ≈ ceil(-1 / log2(p))
-    // where p = mean / (mean + 1)
-    double p = mean / (mean + 1.0);
-    unsigned int m = static_cast<unsigned int>(std::ceil(-1.0 / std::log2(p)));
-    return std::clamp(m, 1u, 65535u);
-}
-
-// Convert stereo to mid-side
-// Using the lossless formulation: mid = (L+R)/2, side = L-R
-// Then recover: L = mid + (side+1)/2, R = mid - (side+1)/2 when side is odd
-void convertToMidSide(const std::vector<int16_t>& left, const std::vector<int16_t>& right,
-                      std::vector<int16_t>& mid, std::vector<int16_t>& side) {
-    size_t n = left.size();
-    mid.resize(n);
-    side.resize(n);
-    
-    for (size_t i = 0; i < n; i++) {
-        int32_t l = left[i];
-        int32_t r = right[i];
-        mid[i] = static_cast<int16_t>((l + r) >> 1);
-        side[i] = static_cast<int16_t>(l - r);
-    }
-}
-
-// Convert mid-side to stereo
-void convertFromMidSide(const std::vector<int16_t>& mid, const std::vector<int16_t>& side,
-                        std::vector<int16_t>& left, std::vector<int16_t>& right) {
-    size_t n = mid.size();
-    left.resize(n);
-    right.resize(n);
-    
-    for (size_t i = 0; i < n; i++) {
-        int32_t m = mid[i];
-        int32_t s = side[i];
-        // Lossless recovery
-        left[i] = static_cast<int16_t>(m + (s >> 1) + (s & 1));
-        right[i] = static_cast<int16_t>(m - (s >> 1));
-    }
-}
+// Where info goes with --stats=json, which reports in JSON instead, where info would have
+static std::ostream silent(nullptr);
 
 void printUsage(const char* progName) {
     std::cout << "Audio Codec - Lossless audio compression using Golomb coding\n\n"
               << "Usage:\n"
               << "  Encoding: " << progName << " -e [options] <input.wav> <output.agol>\n"
-              << "  Decoding: " << progName << " -d <input.agol> <output.wav>\n\n"
+              << "            " << progName << " -e [options] --batch <dir|listfile> --out <dir>\n"
+              << "  Decoding: " << progName << " -d [-t <int>] [--range <start>:<end>] [--stats=json] <input.agol> <output.wav>\n\n"
               << "Options:\n"
-              << "  -p <0-2>  Predictor: 0=Order-1, 1=Order-2 [default], 2=Order-3\n"
-              << "  -s <0-1>  Stereo: 0=Independent, 1=Mid-Side [default]\n"
+              << "  -p <0-4>  Predictor: 0=Order-1, 1=Order-2 [default], 2=Order-3, 3=LPC,\n"
+              << "            4=Adaptive (the best of orders 0-4 and LPC for each block)\n"
+              << "  -l <1-32> Highest LPC order (default: " << LPC_ORDER << ")\n"
+              << "  -b <int>  Block size, " << MIN_FIXED_BLOCK_SIZE << "-" << MAX_BLOCK_SIZE << " (default: " << BLOCK_SIZE << "),\n"
+              << "            or 0 to split each " << FRAME_SIZE << "-frame frame into blocks of "
+              << MIN_BLOCK_SIZE << " or more by bit cost\n"
+              << "  -s <0-4>  Stereo: 0=Independent, 1=Mid-Side [default], 2=Left-Side, 3=Right-Side,\n"
+              << "            4=Adaptive (the best of the others for each block)\n"
               << "  -m <int>  Fixed Golomb m (default: adaptive)\n"
-              << "  -n <0-1>  Negative mode: 0=Interleaved [default], 1=Sign-Magnitude\n\n"
+              << "  -n <0-1>  Negative mode: 0=Interleaved [default], 1=Sign-Magnitude\n"
+              << "  -r        Restrict adaptive m to powers of two (faster Rice coding)\n"
+              << "  -a        Adapt m per sample from the recent residuals, with nothing sent\n"
+              << "            (LOCO-I style; single pass, no block buffering)\n"
+              << "  -q <int>  Limit the unary part to q bits, escaping larger values (default: 0, no limit)\n"
+              << "  -t <int>  Encoding or decoding threads, 0 = all cores (default: 1); with --batch,\n"
+              << "            the number of files encoded at once\n"
+              << "  --batch <dir|listfile>\n"
+              << "            Encode every .wav file in dir, or every file listed (one per line)\n"
+              << "  --out <dir>\n"
+              << "            Where --batch writes its .agol files\n"
+              << "  --range <start>:<end>\n"
+              << "            Decode only this time window, in seconds; either end may be left out\n"
+              << "  --stats=json\n"
+              << "            Report the statistics as JSON, with the time per stage and the m and\n"
+              << "            unary length histograms when built with PROFILE=1\n\n"
+              << "A file name of - reads from stdin or writes to stdout.\n\n"
               << "Examples:\n"
               << "  " << progName << " -e input.wav output.agol\n"
               << "  " << progName << " -e -n 1 input.wav output.agol  # use sign-magnitude\n"
-              << "  " << progName << " -d output.agol decoded.wav\n";
+              << "  " << progName << " -d output.agol decoded.wav\n"
+              << "  " << progName << " -d -t 4 --range 10:20.5 output.agol excerpt.wav\n";
 }
 
-// Encode a single channel
-void encodeChannel(const std::vector<int16_t>& samples, BitStream& bs,
-                   PredictorType predictor, bool adaptiveM, unsigned int fixedM,
-                   GolombCoding::NegativeMode negativeMode) {
-    const size_t BLOCK_SIZE = 1024;
-    size_t numSamples = samples.size();
-    size_t pos = 0;
-    
-    while (pos < numSamples) {
-        size_t blockEnd = std::min(pos + BLOCK_SIZE, numSamples);
-        size_t blockSize = blockEnd - pos;
-        
-        std::vector<int> residuals;
-        residuals.reserve(blockSize);
-        
-        for (size_t i = pos; i < blockEnd; i++) {
-            int16_t prediction = predict(samples, i, predictor);
-            int residual = static_cast<int>(samples[i]) - static_cast<int>(prediction);
-            residuals.push_back(residual);
-        }
-        
-        unsigned int m = adaptiveM ? estimateGolombParameter(residuals) : fixedM;
-        
-        bs.write_n_bits(m, 16);
-        
-        GolombCoding golomb(m, negativeMode);
-        
-        for (int residual : residuals) {
-            std::vector<bool> encoded = golomb.encode(residual);
-            for (bool bit : encoded) {
-                bs.write_bit(bit ? 1 : 0);
-            }
+// Parses "start:end" in seconds (either may be left out) into frames [first, last)
+bool parseRange(const std::string& range, int sampleRate, int64_t frames, int64_t& first, int64_t& last) {
+    size_t colon = range.find(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    try {
+        std::string from = range.substr(0, colon);
+        std::string to = range.substr(colon + 1);
+        double start = from.empty() ? 0.0 : std::stod(from);
+        double end = to.empty() ? -1.0 : std::stod(to);
+        if (start < 0.0 || (end >= 0.0 && end < start)) {
+            return false;
         }
-        
-        pos = blockEnd;
+        first = std::min<int64_t>(static_cast<int64_t>(std::llround(start * sampleRate)), frames);
+        last = end < 0.0 ? frames : std::min<int64_t>(static_cast<int64_t>(std::llround(end * sampleRate)), frames);
+        return true;
+    } catch (const std::logic_error&) {
+        return false;
     }
 }
 
-// Decode a single channel
-std::vector<int16_t> decodeChannel(BitStream& bs, size_t numSamples, PredictorType predictor,
-                                    GolombCoding::NegativeMode negativeMode) {
-    const size_t BLOCK_SIZE = 1024;
-    std::vector<int16_t> samples;
-    samples.reserve(numSamples);
+// Encodes a batch (see batch.h) on threads workers, each with an Encoder of its own
+int encodeBatch(const std::string& batch, const std::string& outDir, const EncoderConfig& config,
+                unsigned int threads, bool jsonStats, std::ostream& report) {
+    std::vector<std::string> inputs;
+    try {
+        inputs = batchInputs(batch, {".wav"});
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    *info << "Encoding " << inputs.size() << " file(s) to " << outDir << " (" << threads << " worker(s))...\n";
     
-    size_t pos = 0;
+    std::vector<std::unique_ptr<Encoder>> encoders(threads);
+    std::vector<std::vector<int16_t>> buffers(threads);
     
-    while (pos < numSamples) {
-        unsigned int m = static_cast<unsigned int>(bs.read_n_bits(16));
-        size_t blockEnd = std::min(pos + BLOCK_SIZE, numSamples);
-        size_t blockSize = blockEnd - pos;
-        
-        GolombCoding golomb(m, negativeMode);
-        
-        for (size_t i = 0; i < blockSize; i++) {
-            std::vector<bool> bits;
-            
-            while (bits.push_back(bs.read_bit() != 0), !bits.back()) {}
-            
-            unsigned int b = static_cast<unsigned int>(std::floor(std::log2(m)));
-            unsigned int cutoff = (1 << (b + 1)) - m;
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<BatchResult> results;
+    try {
+        results = runBatch(inputs, outDir, ".agol", threads, [&](unsigned int worker, BatchResult& result) {
+            if (!encoders[worker]) {
+                encoders[worker] = std::make_unique<Encoder>(config);
+            }
+            Encoder& encoder = *encoders[worker];
+            std::vector<int16_t>& pcm = buffers[worker];
             
-            for (unsigned int j = 0; j < b; j++) {
-                bits.push_back(bs.read_bit() != 0);
+            SndfileHandle sfhIn;
+            {
+                PROFILE_SCOPE(READ);
+                sfhIn = SndfileHandle(result.input);
+            }
+            if (sfhIn.error()) {
+                throw std::runtime_error(sfhIn.strError());
             }
+            int channels = sfhIn.channels();
+            int64_t frames = sfhIn.frames();
             
-            unsigned int r = 0;
-            for (unsigned int j = 0; j < b; j++) {
-                r = (r << 1) | (bits[bits.size() - b + j] ? 1 : 0);
+            BitStream bs(result.output, STREAM_WRITE);
+            encoder.begin(bs, channels, sfhIn.samplerate(), frames);
+            size_t frameSize = encoder.header().frameSize;
+            pcm.resize(frameSize * channels);
+            for (int64_t pos = 0; pos < frames; pos += frameSize) {
+                size_t n = static_cast<size_t>(std::min<int64_t>(frameSize, frames - pos));
+                sf_count_t read;
+                {
+                    PROFILE_SCOPE(READ);
+                    read = sfhIn.readf(pcm.data(), n);
+                }
+                if (read != static_cast<sf_count_t>(n)) {
+                    throw std::runtime_error("input file ended early");
+                }
+                encoder.write(pcm.data(), n);
             }
-            if (r >= cutoff) {
-                bits.push_back(bs.read_bit() != 0);
+            encoder.finish();
+            {
+                PROFILE_SCOPE(WRITE);
+                bs.close();
             }
             
-            auto [residual, bitsUsed] = golomb.decode(bits, 0);
-            int16_t prediction = predict(samples, samples.size(), predictor);
-            int32_t sample = std::clamp(static_cast<int32_t>(prediction) + residual, 
-                                        static_cast<int32_t>(-32768), 
-                                        static_cast<int32_t>(32767));
-            samples.push_back(static_cast<int16_t>(sample));
-        }
-        
-        pos = blockEnd;
+            result.originalSize = frames * channels * sizeof(int16_t);
+            result.compressedSize = bs.tell();
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
     }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
     
-    return samples;
+    printBatchSummary(jsonStats ? report : *info, results, seconds, threads, jsonStats);
+    bool failed = std::any_of(results.begin(), results.end(), [](const BatchResult& result) {
+        return !result.error.empty();
+    });
+    return failed ? 1 : 0;
 }
 
 int main(int argc, char* argv[]) {
@@ -221,108 +176,152 @@ int main(int argc, char* argv[]) {
     }
     
     if (decodeMode) {
-        if (argc != 4) {
+        unsigned int threads = 1;
+        std::string range;
+        bool jsonStats = false;
+        std::string inputFile, outputFile;
+        
+        for (int i = 2; i < argc; i++) {
+            if (std::strcmp(argv[i], "-t") == 0) {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: -t requires a value\n";
+                    return 1;
+                }
+                int count = std::atoi(argv[++i]);
+                if (count < 0) {
+                    std::cerr << "Error: invalid thread count\n";
+                    return 1;
+                }
+                threads = count != 0 ? count : ThreadPool::hardwareThreads();
+            } else if (std::strcmp(argv[i], "--range") == 0) {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: --range requires a value\n";
+                    return 1;
+                }
+                range = argv[++i];
+            } else if (std::strcmp(argv[i], "--stats=json") == 0) {
+                jsonStats = true;
+            } else if (inputFile.empty()) {
+                inputFile = argv[i];
+            } else if (outputFile.empty()) {
+                outputFile = argv[i];
+            } else {
+                std::cerr << "Error: unexpected argument: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        
+        if (inputFile.empty() || outputFile.empty()) {
             std::cerr << "Error: decoding requires input and output files\n";
-            std::cerr << "Usage: " << argv[0] << " -d <input.agol> <output.wav>\n";
+            std::cerr << "Usage: " << argv[0] << " -d [-t threads] [--range start:end] [--stats=json] <input.agol> <output.wav>\n";
             return 1;
         }
-        
-        std::string inputFile = argv[2];
-        std::string outputFile = argv[3];
+        if (outputFile == "-") {
+            info = &std::cerr;
+        }
+        std::ostream* report = info;
+        if (jsonStats) {
+            info = &silent;
+        }
         
         try {
-            std::ifstream header(inputFile, std::ios::binary);
-            if (!header.is_open()) {
-                std::cerr << "Error: cannot open input file\n";
-                return 1;
+            // A regular file is mapped whole, so that version 2 frames can be found
+            // through the seek table; stdin and pipes are decoded as they arrive
+            std::unique_ptr<MmapSource> map;
+            std::unique_ptr<MemorySource> mapped;
+            const uint8_t* data = nullptr;
+            size_t size = 0;
+            auto startTime = std::chrono::steady_clock::now();
+            if (inputFile != "-") {
+                PROFILE_SCOPE(READ);
+                try {
+                    map = std::make_unique<MmapSource>(inputFile);
+                    data = map->borrow(size);
+                    mapped = std::make_unique<MemorySource>(data, size);
+                } catch (const std::ios_base::failure&) {
+                    // Not mappable (empty, a FIFO, ...): read it as a stream
+                }
             }
             
-            char magic[4];
-            header.read(magic, 4);
-            if (std::string(magic, 4) != "AGOL") {
-                std::cerr << "Error: not a valid AGOL audio file\n";
+            std::unique_ptr<BitStream> in;
+            try {
+                in = mapped ? std::make_unique<BitStream>(*mapped)
+                            : std::make_unique<BitStream>(inputFile, STREAM_READ);
+            } catch (const std::ios_base::failure&) {
+                std::cerr << "Error: cannot open input file\n";
                 return 1;
             }
+            BitStream& bs = *in;
             
-            int channels, sampleRate;
-            int64_t frames;
-            
-            header.read(reinterpret_cast<char*>(&channels), sizeof(int));
-            header.read(reinterpret_cast<char*>(&sampleRate), sizeof(int));
-            header.read(reinterpret_cast<char*>(&frames), sizeof(int64_t));
+            Decoder decoder(threads);
+            const AgolHeader& header = decoder.open(bs);
+            int channels = header.channels;
+            int64_t frames = header.frames;
             
-            int predType, stereoType, adaptive, negMode;
-            unsigned int m;
-            
-            header.read(reinterpret_cast<char*>(&predType), sizeof(int));
-            header.read(reinterpret_cast<char*>(&stereoType), sizeof(int));
-            header.read(reinterpret_cast<char*>(&adaptive), sizeof(int));
-            header.read(reinterpret_cast<char*>(&m), sizeof(unsigned int));
-            header.read(reinterpret_cast<char*>(&negMode), sizeof(int));
+            int64_t first = 0, last = frames;
+            if (!range.empty() && !parseRange(range, header.sampleRate, frames, first, last)) {
+                std::cerr << "Error: invalid range (expected start:end in seconds)\n";
+                return 1;
+            }
             
-            PredictorType predictor = static_cast<PredictorType>(predType);
-            StereoMode stereoMode = static_cast<StereoMode>(stereoType);
-            GolombCoding::NegativeMode negativeMode = static_cast<GolombCoding::NegativeMode>(negMode);
-
-            header.close();
+            *info << "Decoding: " << channels << " channel(s), "
+                  << header.sampleRate << " Hz, " << frames << " frames (AGOL v" << header.version << ")\n";
+            if (!range.empty()) {
+                *info << "Range: frames " << first << " to " << last << "\n";
+            }
             
-            std::cout << "Decoding: " << channels << " channel(s), "
-                      << sampleRate << " Hz, " << frames << " frames\n";
+            SndfileHandle sfhOut(outputFile, SFM_WRITE, SF_FORMAT_WAV | SF_FORMAT_PCM_16,
+                                 channels, header.sampleRate);
             
-            std::fstream fs(inputFile, std::ios::binary | std::ios::in);
-            if (!fs.is_open()) {
-                std::cerr << "Error: cannot open input file\n";
+            if (sfhOut.error()) {
+                std::cerr << "Error: cannot create output WAV file\n";
+                std::cerr << sfhOut.strError() << "\n";
                 return 1;
             }
             
-            // Skip header
-            fs.seekg(4 + sizeof(int) * 6 + sizeof(int64_t) + sizeof(unsigned int));
-            
-            BitStream bs(fs, true);
-            
-            std::vector<int16_t> samples;
+            // Frames are written out as soon as they are decoded
+            auto writeFrames = [&](const int16_t* pcm, size_t n) {
+                PROFILE_SCOPE(WRITE);
+                if (sfhOut.writef(pcm, n) != static_cast<sf_count_t>(n)) {
+                    throw std::runtime_error("cannot write the output WAV file");
+                }
+            };
             
-            if (channels == 1) {
-                std::cout << "Decoding mono channel...\n";
-                samples = decodeChannel(bs, frames, predictor, negativeMode);
-            } else if (channels == 2) {
-                std::cout << "Decoding stereo channels...\n";
-                std::vector<int16_t> ch1 = decodeChannel(bs, frames, predictor, negativeMode);
-                std::vector<int16_t> ch2 = decodeChannel(bs, frames, predictor, negativeMode);
-                
-                if (stereoMode == StereoMode::MID_SIDE) {
-                    std::cout << "Converting from mid-side...\n";
-                    std::vector<int16_t> left, right;
-                    convertFromMidSide(ch1, ch2, left, right);
-                    
-                    samples.reserve(frames * 2);
-                    for (size_t i = 0; i < static_cast<size_t>(frames); i++) {
-                        samples.push_back(left[i]);
-                        samples.push_back(right[i]);
-                    }
+            if (data != nullptr) {
+                if (header.version >= 2) {
+                    *info << "Decoding frames through the seek table (" << threads << " thread(s))...\n";
                 } else {
-                    samples.reserve(frames * 2);
-                    for (size_t i = 0; i < static_cast<size_t>(frames); i++) {
-                        samples.push_back(ch1[i]);
-                        samples.push_back(ch2[i]);
-                    }
+                    *info << "Decoding...\n";
                 }
+                decoder.decode(data, size, first, last, writeFrames);
+            } else {
+                *info << "Decoding...\n";
+                decoder.decode(bs, first, last, writeFrames);
             }
             
             bs.close();
             
-            SndfileHandle sfhOut(outputFile, SFM_WRITE, SF_FORMAT_WAV | SF_FORMAT_PCM_16,
-                                 channels, sampleRate);
-            
-            if (sfhOut.error()) {
-                std::cerr << "Error: cannot create output WAV file\n";
-                std::cerr << sfhOut.strError() << "\n";
-                return 1;
+            if (jsonStats) {
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+                double decodedSize = static_cast<double>(last > first ? last - first : 0) * channels * sizeof(int16_t);
+                *report << "{\n  \"mode\": \"decode\",\n"
+                        << "  \"input\": " << profile::jsonString(inputFile) << ",\n"
+                        << "  \"output\": " << profile::jsonString(outputFile) << ",\n"
+                        << "  \"version\": " << header.version << ",\n"
+                        << "  \"channels\": " << channels << ",\n"
+                        << "  \"sample_rate\": " << header.sampleRate << ",\n"
+                        << "  \"frames\": " << frames << ",\n"
+                        << "  \"first\": " << first << ",\n"
+                        << "  \"last\": " << last << ",\n"
+                        << "  \"threads\": " << threads << ",\n"
+                        << "  \"seconds\": " << seconds << ",\n"
+                        << "  \"mb_per_s\": " << (decodedSize / 1e6) / seconds << ",\n"
+                        << "  \"profile\": ";
+                profile::writeJson(*report, profile::total());
+                *report << "\n}\n";
             }
             
-            sfhOut.writef(samples.data(), frames);
-            
-            std::cout << "Decoding successful!\n";
+            *info << "Decoding successful!\n";
             return 0;
             
         } catch (const std::exception& e) {
@@ -334,8 +333,16 @@ int main(int argc, char* argv[]) {
     PredictorType predictor = PredictorType::ORDER_2;
     StereoMode stereoMode = StereoMode::MID_SIDE;
     bool adaptiveM = true;
+    bool perSampleM = false;
     unsigned int fixedM = 16;
+    bool riceOnly = false;
     GolombCoding::NegativeMode negativeMode = GolombCoding::INTERLEAVED;
+    unsigned int maxQuotient = 0;
+    unsigned int threads = 1;
+    int lpcOrder = LPC_ORDER;
+    int blockSize = BLOCK_SIZE;
+    bool jsonStats = false;
+    std::string batch, outDir;
     
     std::string inputFile, outputFile;
     
@@ -351,10 +358,34 @@ int main(int argc, char* argv[]) {
                 case 0: predictor = PredictorType::ORDER_1; break;
                 case 1: predictor = PredictorType::ORDER_2; break;
                 case 2: predictor = PredictorType::ORDER_3; break;
+                case 3: predictor = PredictorType::LPC; break;
+                case 4: predictor = PredictorType::ADAPTIVE; break;
                 default:
-                    std::cerr << "Error: invalid predictor type (must be 0-2)\n";
+                    std::cerr << "Error: invalid predictor type (must be 0-4)\n";
                     return 1;
             }
+        } else if (std::strcmp(argv[i], "-l") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: -l requires a value\n";
+                return 1;
+            }
+            lpcOrder = std::atoi(argv[++i]);
+            if (lpcOrder < 1 || lpcOrder > LpcFilter::MAX_ORDER) {
+                std::cerr << "Error: invalid LPC order (must be 1-32)\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "-b") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: -b requires a value\n";
+                return 1;
+            }
+            blockSize = std::atoi(argv[++i]);
+            if (blockSize != 0 && (blockSize < static_cast<int>(MIN_FIXED_BLOCK_SIZE)
+                                   || blockSize > static_cast<int>(MAX_BLOCK_SIZE))) {
+                std::cerr << "Error: invalid block size (must be 0 or "
+                          << MIN_FIXED_BLOCK_SIZE << "-" << MAX_BLOCK_SIZE << ")\n";
+                return 1;
+            }
         } else if (std::strcmp(argv[i], "-s") == 0) {
             if (i + 1 >= argc) {
                 std::cerr << "Error: -s requires a value\n";
@@ -364,8 +395,11 @@ int main(int argc, char* argv[]) {
             switch (mode) {
                 case 0: stereoMode = StereoMode::INDEPENDENT; break;
                 case 1: stereoMode = StereoMode::MID_SIDE; break;
+                case 2: stereoMode = StereoMode::LEFT_SIDE; break;
+                case 3: stereoMode = StereoMode::RIGHT_SIDE; break;
+                case 4: stereoMode = StereoMode::ADAPTIVE; break;
                 default:
-                    std::cerr << "Error: invalid stereo mode (must be 0 or 1)\n";
+                    std::cerr << "Error: invalid stereo mode (must be 0-4)\n";
                     return 1;
             }
         } else if (std::strcmp(argv[i], "-m") == 0) {
@@ -379,6 +413,10 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             adaptiveM = false;
+            perSampleM = false;
+        } else if (std::strcmp(argv[i], "-a") == 0) {
+            adaptiveM = true;
+            perSampleM = true;
         } else if (std::strcmp(argv[i], "-n") == 0) {
             if (i + 1 >= argc) {
                 std::cerr << "Error: -n requires a value\n";
@@ -392,6 +430,44 @@ int main(int argc, char* argv[]) {
                     std::cerr << "Error: invalid negative mode (must be 0 or 1)\n";
                     return 1;
             }
+        } else if (std::strcmp(argv[i], "-r") == 0) {
+            riceOnly = true;
+        } else if (std::strcmp(argv[i], "-q") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: -q requires a value\n";
+                return 1;
+            }
+            int limit = std::atoi(argv[++i]);
+            if (limit < 0 || limit > 0xffffff) {
+                std::cerr << "Error: invalid unary limit (must be 0-16777215)\n";
+                return 1;
+            }
+            maxQuotient = limit;
+        } else if (std::strcmp(argv[i], "-t") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: -t requires a value\n";
+                return 1;
+            }
+            int count = std::atoi(argv[++i]);
+            if (count < 0) {
+                std::cerr << "Error: invalid thread count\n";
+                return 1;
+            }
+            threads = count != 0 ? count : ThreadPool::hardwareThreads();
+        } else if (std::strcmp(argv[i], "--stats=json") == 0) {
+            jsonStats = true;
+        } else if (std::strcmp(argv[i], "--batch") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --batch requires a value\n";
+                return 1;
+            }
+            batch = argv[++i];
+        } else if (std::strcmp(argv[i], "--out") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --out requires a value\n";
+                return 1;
+            }
+            outDir = argv[++i];
         } else {
             if (inputFile.empty()) {
                 inputFile = argv[i];
@@ -405,36 +481,73 @@ int main(int argc, char* argv[]) {
         i++;
     }
     
-    if (inputFile.empty() || outputFile.empty()) {
+    if (!batch.empty() || !outDir.empty()) {
+        if (batch.empty() || outDir.empty() || !inputFile.empty()) {
+            std::cerr << "Error: --batch and --out go together, without input and output files\n";
+            return 1;
+        }
+    } else if (inputFile.empty() || outputFile.empty()) {
         std::cerr << "Error: both input and output files must be specified\n";
         printUsage(argv[0]);
         return 1;
     }
+    if (outputFile == "-") {
+        info = &std::cerr;
+    }
+    std::ostream* report = info;
+    if (jsonStats) {
+        info = &silent;
+    }
     
-    std::cout << "Audio Codec Configuration:\n";
-    std::cout << "  Predictor: ";
+    *info << "Audio Codec Configuration:\n";
+    *info << "  Predictor: ";
     switch (predictor) {
-        case PredictorType::ORDER_1: std::cout << "Order-1\n"; break;
-        case PredictorType::ORDER_2: std::cout << "Order-2\n"; break;
-        case PredictorType::ORDER_3: std::cout << "Order-3\n"; break;
+        case PredictorType::ORDER_1: *info << "Order-1\n"; break;
+        case PredictorType::ORDER_2: *info << "Order-2\n"; break;
+        case PredictorType::ORDER_3: *info << "Order-3\n"; break;
+        case PredictorType::LPC: *info << "LPC (order up to " << lpcOrder << ")\n"; break;
+        case PredictorType::ADAPTIVE: *info << "Adaptive per block (LPC order up to " << lpcOrder << ")\n"; break;
+        default: break;
     }
-    std::cout << "  Stereo mode: ";
+    *info << "  Stereo mode: ";
     switch (stereoMode) {
-        case StereoMode::INDEPENDENT: std::cout << "Independent\n"; break;
-        case StereoMode::MID_SIDE: std::cout << "Mid-Side\n"; break;
+        case StereoMode::INDEPENDENT: *info << "Independent\n"; break;
+        case StereoMode::MID_SIDE: *info << "Mid-Side\n"; break;
+        case StereoMode::LEFT_SIDE: *info << "Left-Side\n"; break;
+        case StereoMode::RIGHT_SIDE: *info << "Right-Side\n"; break;
+        case StereoMode::ADAPTIVE: *info << "Adaptive per block\n"; break;
+    }
+    *info << "  Block size: ";
+    if (blockSize == 0) {
+        *info << "Variable (" << MIN_BLOCK_SIZE << "-" << FRAME_SIZE << ")\n";
+    } else {
+        *info << blockSize << "\n";
     }
-    std::cout << "  Golomb parameter: ";
-    if (adaptiveM) {
-        std::cout << "Adaptive\n";
+    *info << "  Golomb parameter: ";
+    if (perSampleM) {
+        *info << "Adaptive per sample\n";
+    } else if (adaptiveM) {
+        *info << (riceOnly ? "Adaptive (powers of two)\n" : "Adaptive\n");
     } else {
-        std::cout << "Fixed (m=" << fixedM << ")\n";
+        *info << "Fixed (m=" << fixedM << ")\n";
     }
-    std::cout << "  Negative mode: ";
+    *info << "  Negative mode: ";
     switch (negativeMode) {
-        case GolombCoding::INTERLEAVED: std::cout << "Interleaved\n"; break;
-        case GolombCoding::SIGN_MAGNITUDE: std::cout << "Sign-Magnitude\n"; break;
+        case GolombCoding::INTERLEAVED: *info << "Interleaved\n"; break;
+        case GolombCoding::SIGN_MAGNITUDE: *info << "Sign-Magnitude\n"; break;
+    }
+    if (maxQuotient != 0) {
+        *info << "  Unary limit: " << maxQuotient << " (then " << ESCAPE_BITS << "-bit escape)\n";
+    }
+    *info << "  Threads: " << threads << "\n\n";
+    
+    EncoderConfig config{predictor, stereoMode, adaptiveM, perSampleM, fixedM, riceOnly, negativeMode, maxQuotient,
+                         lpcOrder, static_cast<unsigned int>(blockSize)};
+    if (!batch.empty()) {
+        return encodeBatch(batch, outDir, config, threads, jsonStats, *report);
     }
-    std::cout << "\nEncoding " << inputFile << " to " << outputFile << "...\n\n";
+    
+    *info << "Encoding " << inputFile << " to " << outputFile << "...\n\n";
     
     try {
         SndfileHandle sfhIn(inputFile);
@@ -448,92 +561,141 @@ int main(int argc, char* argv[]) {
         int sampleRate = sfhIn.samplerate();
         int64_t frames = sfhIn.frames();
         
-        std::cout << "Input: " << channels << " channel(s), " 
-                  << sampleRate << " Hz, " 
-                  << frames << " frames\n";
+        *info << "Input: " << channels << " channel(s), " 
+              << sampleRate << " Hz, " 
+              << frames << " frames\n";
         
-        std::ofstream headerFile(outputFile, std::ios::binary | std::ios::trunc);
-        if (!headerFile.is_open()) {
-            std::cerr << "Error: cannot create output file\n";
+        if (channels != 1 && channels != 2) {
+            std::cerr << "Error: only mono and stereo audio supported\n";
             return 1;
         }
         
-        headerFile.write("AGOL", 4);
-        
-        headerFile.write(reinterpret_cast<const char*>(&channels), sizeof(int));
-        headerFile.write(reinterpret_cast<const char*>(&sampleRate), sizeof(int));
-        headerFile.write(reinterpret_cast<const char*>(&frames), sizeof(int64_t));
-        
-        int predType = static_cast<int>(predictor);
-        int stereoType = static_cast<int>(stereoMode);
-        int adaptive = adaptiveM ? 1 : 0;
-        int negMode = static_cast<int>(negativeMode);
+        // Memory-mapped (or stdout for "-"); the header goes through the same stream
+        BitStream bs(outputFile, STREAM_WRITE);
         
-        headerFile.write(reinterpret_cast<const char*>(&predType), sizeof(int));
-        headerFile.write(reinterpret_cast<const char*>(&stereoType), sizeof(int));
-        headerFile.write(reinterpret_cast<const char*>(&adaptive), sizeof(int));
-        headerFile.write(reinterpret_cast<const char*>(&fixedM), sizeof(unsigned int));
-        headerFile.write(reinterpret_cast<const char*>(&negMode), sizeof(int));
+        Encoder encoder(config, threads);
+        encoder.begin(bs, channels, sampleRate, frames);
+        const AgolHeader& header = encoder.header();
         
-        headerFile.close();
-        
-        std::vector<int16_t> samples(frames * channels);
-        sfhIn.readf(samples.data(), frames);
-        
-        std::fstream fs(outputFile, std::ios::binary | std::ios::in | std::ios::out | std::ios::ate);
-        BitStream bs(fs, false);
+        auto startTime = std::chrono::steady_clock::now();
         
         if (channels == 1) {
-            std::cout << "Encoding mono channel...\n";
-            encodeChannel(samples, bs, predictor, adaptiveM, fixedM, negativeMode);
-        } else if (channels == 2) {
-            std::vector<int16_t> left, right;
-            left.reserve(frames);
-            right.reserve(frames);
-            
-            for (int64_t i = 0; i < frames; i++) {
-                left.push_back(samples[i * 2]);
-                right.push_back(samples[i * 2 + 1]);
+            *info << "Encoding mono channel...\n";
+        } else if (stereoMode == StereoMode::MID_SIDE) {
+            *info << "Encoding with mid-side stereo...\n";
+        } else if (stereoMode == StereoMode::LEFT_SIDE) {
+            *info << "Encoding with left-side stereo...\n";
+        } else if (stereoMode == StereoMode::RIGHT_SIDE) {
+            *info << "Encoding with right-side stereo...\n";
+        } else if (stereoMode == StereoMode::ADAPTIVE) {
+            *info << "Encoding with the stereo mode chosen per block...\n";
+        } else {
+            *info << "Encoding left and right channels independently...\n";
+        }
+        
+        // Read one frame at a time, so memory use does not depend on the file length
+        std::vector<int16_t> pcm(static_cast<size_t>(header.frameSize) * channels);
+        for (int64_t pos = 0; pos < frames; pos += header.frameSize) {
+            size_t n = static_cast<size_t>(std::min<int64_t>(header.frameSize, frames - pos));
+            sf_count_t read;
+            {
+                PROFILE_SCOPE(READ);
+                read = sfhIn.readf(pcm.data(), n);
             }
-            
-            if (stereoMode == StereoMode::MID_SIDE) {
-                std::cout << "Encoding with mid-side stereo...\n";
-                std::vector<int16_t> mid, side;
-                convertToMidSide(left, right, mid, side);
-                
-                encodeChannel(mid, bs, predictor, adaptiveM, fixedM, negativeMode);
-                encodeChannel(side, bs, predictor, adaptiveM, fixedM, negativeMode);
-            } else {
-                std::cout << "Encoding left and right channels independently...\n";
-                encodeChannel(left, bs, predictor, adaptiveM, fixedM, negativeMode);
-                encodeChannel(right, bs, predictor, adaptiveM, fixedM, negativeMode);
+            if (read != static_cast<sf_count_t>(n)) {
+                std::cerr << "Error: input file ended early\n";
+                bs.close();
+                return 1;
             }
-        } else {
-            std::cerr << "Error: only mono and stereo audio supported\n";
-            bs.close();
-            return 1;
+            encoder.write(pcm.data(), n);
         }
+        encoder.finish();
         
-        bs.close();
+        {
+            PROFILE_SCOPE(WRITE);
+            bs.close();
+        }
         
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
         size_t originalSize = frames * channels * sizeof(int16_t);
         
-        std::ifstream compressed(outputFile, std::ios::binary | std::ios::ate);
-        size_t compressedSize = compressed.tellg();
-        compressed.close();
+        size_t compressedSize = bs.tell();
         
         double compressionRatio = static_cast<double>(originalSize) / compressedSize;
         double bitsPerSample = (static_cast<double>(compressedSize) * 8.0) / (frames * channels);
         
-        std::cout << "\nCompression statistics:\n";
-        std::cout << "  Original size: " << originalSize << " bytes\n";
-        std::cout << "  Compressed size: " << compressedSize << " bytes\n";
-        std::cout << "  Compression ratio: " << compressionRatio << ":1\n";
-        std::cout << "  Bits per sample: " << bitsPerSample << "\n";
-        std::cout << "  Compression achieved: " 
-                  << (100.0 * (1.0 - 1.0/compressionRatio)) << "%\n";
+        const CodingStats& stats = encoder.stats();
+        
+        *info << "\nCompression statistics:\n";
+        *info << "  Original size: " << originalSize << " bytes\n";
+        *info << "  Compressed size: " << compressedSize << " bytes\n";
+        *info << "  Compression ratio: " << compressionRatio << ":1\n";
+        *info << "  Bits per sample: " << bitsPerSample << "\n";
+        *info << "  Compression achieved: " 
+              << (100.0 * (1.0 - 1.0/compressionRatio)) << "%\n";
+        *info << "  Rice-coded blocks: " << stats.riceBlocks << "/" << stats.blocks
+              << " (" << (stats.blocks ? 100.0 * stats.riceBlocks / stats.blocks : 0.0) << "%)\n";
+        if (predictor == PredictorType::ADAPTIVE) {
+            static const char* names[PREDICTOR_TYPES] = {"order 1", "order 2", "order 3", "LPC", "order 0", "order 4"};
+            *info << "  Predictors chosen:";
+            for (int p = 0; p < PREDICTOR_TYPES; p++) {
+                *info << (p ? ", " : " ") << names[p] << " " << stats.predictorBlocks[p];
+            }
+            *info << "\n";
+        }
+        if (blockSize == 0 && stats.frameBlocks != 0) {
+            *info << "  Blocks: " << stats.frameBlocks << " (" << static_cast<double>(frames) / stats.frameBlocks
+                  << " frames on average)\n";
+        }
+        *info << "  Constant blocks: " << stats.constantBlocks << ", verbatim: " << stats.verbatimBlocks
+              << ", with wasted bits: " << stats.wastedBlocks << "\n";
+        if (channels == 2 && stereoMode == StereoMode::ADAPTIVE) {
+            static const char* names[STEREO_MODES] = {"independent", "mid-side", "left-side", "right-side"};
+            *info << "  Stereo modes chosen:";
+            for (int m = 0; m < STEREO_MODES; m++) {
+                *info << (m ? ", " : " ") << names[m] << " " << stats.stereoBlocks[m];
+            }
+            *info << "\n";
+        }
+        *info << "  Encoding time: " << seconds << " s ("
+              << (originalSize / 1e6) / seconds << " MB/s)\n";
+        
+        if (jsonStats) {
+            static const char* predictorNames[PREDICTOR_TYPES] = {"order_1", "order_2", "order_3", "lpc", "order_0", "order_4"};
+            static const char* stereoNames[STEREO_MODES] = {"independent", "mid_side", "left_side", "right_side"};
+            *report << "{\n  \"mode\": \"encode\",\n"
+                    << "  \"input\": " << profile::jsonString(inputFile) << ",\n"
+                    << "  \"output\": " << profile::jsonString(outputFile) << ",\n"
+                    << "  \"channels\": " << channels << ",\n"
+                    << "  \"sample_rate\": " << sampleRate << ",\n"
+                    << "  \"frames\": " << frames << ",\n"
+                    << "  \"original_bytes\": " << originalSize << ",\n"
+                    << "  \"compressed_bytes\": " << compressedSize << ",\n"
+                    << "  \"ratio\": " << compressionRatio << ",\n"
+                    << "  \"bits_per_sample\": " << bitsPerSample << ",\n"
+                    << "  \"threads\": " << threads << ",\n"
+                    << "  \"seconds\": " << seconds << ",\n"
+                    << "  \"mb_per_s\": " << (originalSize / 1e6) / seconds << ",\n"
+                    << "  \"blocks\": " << stats.blocks << ",\n"
+                    << "  \"rice_blocks\": " << stats.riceBlocks << ",\n"
+                    << "  \"constant_blocks\": " << stats.constantBlocks << ",\n"
+                    << "  \"verbatim_blocks\": " << stats.verbatimBlocks << ",\n"
+                    << "  \"wasted_blocks\": " << stats.wastedBlocks << ",\n"
+                    << "  \"frame_blocks\": " << stats.frameBlocks << ",\n"
+                    << "  \"predictor_blocks\": {";
+            for (int p = 0; p < PREDICTOR_TYPES; p++) {
+                *report << (p ? ", " : "") << "\"" << predictorNames[p] << "\": " << stats.predictorBlocks[p];
+            }
+            *report << "},\n  \"stereo_blocks\": {";
+            for (int m = 0; m < STEREO_MODES; m++) {
+                *report << (m ? ", " : "") << "\"" << stereoNames[m] << "\": " << stats.stereoBlocks[m];
+            }
+            *report << "},\n  \"profile\": ";
+            profile::writeJson(*report, profile::total());
+            *report << "\n}\n";
+        }
         
-        std::cout << "\nEncoding successful!\n";
+        *info << "\nEncoding successful!\n";
         return 0;
         
     } catch (const std::exception& e) {
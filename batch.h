@@ -0,0 +1,173 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "profile.h"
+#include "thread_pool.h"
+
+// Batch mode of the codecs (-e --batch <dir|listfile> --out <dir>): many files coded in
+// one process, several at a time, each on one thread of a pool with state of its own
+// that is kept from one file to the next
+
+// One file of a batch; error is empty if it was coded
+struct BatchResult {
+    std::string input;
+    std::string output;
+    size_t originalSize = 0;
+    size_t compressedSize = 0;
+    std::string error;
+};
+
+// The files of directory path whose extension (in lower case) is one of extensions, in
+// name order; or, if path is not a directory, those listed in it, one per line
+inline std::vector<std::string> batchInputs(const std::string& path, const std::vector<std::string>& extensions) {
+    std::vector<std::string> inputs;
+    if (std::filesystem::is_directory(path)) {
+        for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(path)) {
+            std::string extension = entry.path().extension().string();
+            std::transform(extension.begin(), extension.end(), extension.begin(),
+                           [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+            if (entry.is_regular_file()
+                && std::find(extensions.begin(), extensions.end(), extension) != extensions.end()) {
+                inputs.push_back(entry.path().string());
+            }
+        }
+        std::sort(inputs.begin(), inputs.end());
+        return inputs;
+    }
+
+    std::ifstream list(path);
+    if (!list) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            inputs.push_back(line);
+        }
+    }
+    return inputs;
+}
+
+// Codes each of inputs into outDir, as its name with extension in place of its own, with
+// code(worker, result) on threads workers (worker: 0 to threads - 1, each running one
+// file at a time). code sets the sizes, and throws on failure; the output is then
+// removed, the error reported on std::cerr, and the batch goes on.
+inline std::vector<BatchResult> runBatch(const std::vector<std::string>& inputs, const std::string& outDir,
+                                         const std::string& extension, unsigned int threads,
+                                         const std::function<void(unsigned int, BatchResult&)>& code) {
+    std::filesystem::create_directories(outDir);
+    std::vector<BatchResult> results(inputs.size());
+    std::set<std::string> outputs;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        results[i].input = inputs[i];
+        std::filesystem::path name = std::filesystem::path(inputs[i]).filename();
+        results[i].output = (std::filesystem::path(outDir) / name.replace_extension(extension)).string();
+        if (!outputs.insert(results[i].output).second) {
+            results[i].error = "output " + results[i].output + " taken by another input";
+            std::cerr << "Error: " << results[i].input << ": " << results[i].error << "\n";
+        }
+    }
+
+    std::atomic<size_t> next = 0;
+    std::mutex errors;
+    auto work = [&](unsigned int worker) {
+        for (size_t i; (i = next++) < results.size();) {
+            BatchResult& result = results[i];
+            if (!result.error.empty()) {
+                continue;
+            }
+            try {
+                code(worker, result);
+            } catch (const std::exception& e) {
+                result.error = e.what();
+                std::error_code ignored;
+                std::filesystem::remove(result.output, ignored);
+                std::lock_guard<std::mutex> lock(errors);
+                std::cerr << "Error: " << result.input << ": " << result.error << "\n";
+            }
+        }
+    };
+
+    threads = std::max(1u, static_cast<unsigned int>(std::min<size_t>(threads, results.size())));
+    if (threads == 1) {
+        work(0);
+        return results;
+    }
+    ThreadPool pool(threads);
+    std::vector<std::future<void>> workers;
+    for (unsigned int w = 0; w < threads; w++) {
+        workers.push_back(pool.submit([&work, w] { work(w); }));
+    }
+    for (std::future<void>& worker : workers) {
+        worker.get();
+    }
+    return results;
+}
+
+// Totals of a batch coded in seconds, as text or (json) as a JSON object
+inline void printBatchSummary(std::ostream& out, const std::vector<BatchResult>& results, double seconds,
+                              unsigned int threads, bool json) {
+    size_t failed = 0;
+    size_t originalSize = 0, compressedSize = 0;
+    for (const BatchResult& result : results) {
+        if (!result.error.empty()) {
+            failed++;
+            continue;
+        }
+        originalSize += result.originalSize;
+        compressedSize += result.compressedSize;
+    }
+    double ratio = compressedSize != 0 ? static_cast<double>(originalSize) / compressedSize : 0.0;
+    double rate = seconds > 0.0 ? (originalSize / 1e6) / seconds : 0.0;
+
+    if (!json) {
+        out << "\nBatch statistics:\n";
+        out << "  Files: " << results.size() << " (" << results.size() - failed << " coded, "
+            << failed << " failed)\n";
+        out << "  Original size: " << originalSize << " bytes\n";
+        out << "  Compressed size: " << compressedSize << " bytes\n";
+        out << "  Compression ratio: " << ratio << ":1\n";
+        out << "  Time: " << seconds << " s (" << rate << " MB/s, " << threads << " worker(s))\n";
+        return;
+    }
+
+    out << "{\n  \"mode\": \"batch_encode\",\n"
+        << "  \"files\": " << results.size() << ",\n"
+        << "  \"failed\": " << failed << ",\n"
+        << "  \"original_bytes\": " << originalSize << ",\n"
+        << "  \"compressed_bytes\": " << compressedSize << ",\n"
+        << "  \"ratio\": " << ratio << ",\n"
+        << "  \"threads\": " << threads << ",\n"
+        << "  \"seconds\": " << seconds << ",\n"
+        << "  \"mb_per_s\": " << rate << ",\n"
+        << "  \"failures\": [";
+    bool first = true;
+    for (const BatchResult& result : results) {
+        if (!result.error.empty()) {
+            out << (first ? "\n" : ",\n") << "    {\"input\": " << profile::jsonString(result.input)
+                << ", \"error\": " << profile::jsonString(result.error) << "}";
+            first = false;
+        }
+    }
+    out << (first ? "],\n" : "\n  ],\n") << "  \"profile\": ";
+    profile::writeJson(out, profile::total());
+    out << "\n}\n";
+}
+
+#endif
@@ -0,0 +1,303 @@
+//------------------------------------------------------------------------------
+//
+// Entropy coding micro-benchmark: GolombCoding encode/decode over a sweep of m,
+// both negative modes and synthetic residuals, raw BitStream field I/O, and the
+// choice of m per block (mean estimate against GolombCostModel).
+// Streams are kept in memory (MemorySink/MemorySource) so that only the coding
+// is timed; each case is the best of several runs.
+//
+// Output is CSV, one row per case, with a header line:
+//
+//   target         golomb | bitstream | selector
+//   op             encode | decode (golomb), write | read (bitstream),
+//                  estimate | exact (selector: time to choose m, bytes when coded
+//                  with the chosen m; -b sets the block length)
+//   distribution   laplacian (two-sided geometric), geometric (non-negative)
+//                  or uniform (bitstream)
+//   scale          mean magnitude of the residuals (bitstream: field width)
+//   neg_mode       interleaved | sign_magnitude (bitstream: -)
+//   m              Golomb parameter (bitstream, selector: 0)
+//   samples, bytes, bits_per_sample
+//   ns_per_sample, msamples_per_s, mb_per_s (coded bytes per second)
+//
+// Decoded values are checked; the exit status is 1 if any case mismatched.
+//
+//------------------------------------------------------------------------------
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <span>
+#include "Golomb.h"
+#include "bit_stream.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+
+struct Options {
+	size_t samples { 1 << 20 };
+	int repeats { 3 };
+	vector<double> scales { 1, 4, 16, 64 };
+	vector<unsigned> ms { 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 128, 256 };
+	size_t block { 1024 };
+};
+
+static vector<int> make_residuals(const string& distribution, double scale, size_t n) {
+	mt19937 rng { 2025 };
+	// Mean of a geometric distribution is (1 - p) / p
+	geometric_distribution<int> magnitude { 1.0 / (scale + 1.0) };
+	bernoulli_distribution negative { 0.5 };
+
+	vector<int> v(n);
+	for(auto& x : v) {
+		x = magnitude(rng);
+		if(distribution == "laplacian" && negative(rng))
+			x = -x;
+	}
+
+	return v;
+}
+
+// Best of repeats runs of f, in seconds
+static double best_time(int repeats, const function<void()>& f) {
+	double best = 1e30;
+	for(int i = 0 ; i < repeats ; ++i) {
+		auto t0 = chrono::steady_clock::now();
+		f();
+		best = min(best, chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+	}
+
+	return best;
+}
+
+static void print_header() {
+	cout << "target,op,distribution,scale,neg_mode,m,samples,bytes,bits_per_sample,"
+		 << "ns_per_sample,msamples_per_s,mb_per_s\n";
+}
+
+static void print_row(const string& target, const string& op, const string& distribution, double scale,
+  const string& neg_mode, unsigned m, size_t samples, size_t bytes, double seconds) {
+	cout << target << ',' << op << ',' << distribution << ',' << scale << ',' << neg_mode << ','
+		 << m << ',' << samples << ',' << bytes << ',' << 8.0 * bytes / samples << ','
+		 << 1e9 * seconds / samples << ',' << samples / seconds / 1e6 << ','
+		 << bytes / seconds / 1e6 << '\n';
+}
+
+//------------------------------------------------------------------------------
+
+static bool bench_golomb(const Options& opt) {
+	bool ok = true;
+	vector<uint8_t> buf;
+
+	for(const string distribution : { "laplacian", "geometric" })
+		for(double scale : opt.scales) {
+			vector<int> residuals = make_residuals(distribution, scale, opt.samples);
+			vector<int> decoded(residuals.size());
+
+			for(auto mode : { GolombCoding::INTERLEAVED, GolombCoding::SIGN_MAGNITUDE }) {
+				string mode_name = mode == GolombCoding::INTERLEAVED ? "interleaved" : "sign_magnitude";
+
+				for(unsigned m : opt.ms) {
+					GolombCoding golomb { m, mode };
+
+					double enc = best_time(opt.repeats, [&] {
+						buf.clear();
+						MemorySink sink { buf };
+						BitStream bs { sink };
+						golomb.encodeBlock(residuals, bs);
+						bs.close();
+					});
+
+					double dec = best_time(opt.repeats, [&] {
+						MemorySource source { buf };
+						BitStream bs { source };
+						golomb.decodeBlock(decoded, bs);
+					});
+
+					if(decoded != residuals) {
+						cerr << "MISMATCH: " << distribution << " scale " << scale << ' ' << mode_name
+							 << " m " << m << '\n';
+						ok = false;
+					}
+
+					print_row("golomb", "encode", distribution, scale, mode_name, m, residuals.size(), buf.size(), enc);
+					print_row("golomb", "decode", distribution, scale, mode_name, m, residuals.size(), buf.size(), dec);
+				}
+			}
+		}
+
+	return ok;
+}
+
+static bool bench_bit_stream(const Options& opt) {
+	bool ok = true;
+	vector<uint8_t> buf;
+	mt19937_64 rng { 2025 };
+
+	for(int width : { 1, 4, 8, 13, 16, 24, 32, 57 }) {
+		vector<uint64_t> values(opt.samples);
+		for(auto& x : values)
+			x = rng() & (~uint64_t(0) >> (64 - width));
+
+		double wr = best_time(opt.repeats, [&] {
+			buf.clear();
+			MemorySink sink { buf };
+			BitStream bs { sink };
+			for(uint64_t x : values)
+				bs.write_n_bits(x, width);
+			bs.close();
+		});
+
+		bool same = true;
+		double rd = best_time(opt.repeats, [&] {
+			MemorySource source { buf };
+			BitStream bs { source };
+			same = true;
+			for(uint64_t x : values)
+				same &= bs.read_n_bits(width) == x;
+		});
+
+		if(not same) {
+			cerr << "MISMATCH: bitstream width " << width << '\n';
+			ok = false;
+		}
+
+		print_row("bitstream", "write", "uniform", width, "-", 0, values.size(), buf.size(), wr);
+		print_row("bitstream", "read", "uniform", width, "-", 0, values.size(), buf.size(), rd);
+	}
+
+	return ok;
+}
+
+static bool bench_selector(const Options& opt) {
+	bool ok = true;
+	vector<uint8_t> buf;
+
+	for(const string distribution : { "laplacian", "geometric" })
+		for(double scale : opt.scales) {
+			vector<int> residuals = make_residuals(distribution, scale, opt.samples);
+			size_t n_blocks = (residuals.size() + opt.block - 1) / opt.block;
+			auto block = [&](size_t i) {
+				size_t start = i * opt.block;
+				return span<const int>(residuals).subspan(start, min(opt.block, residuals.size() - start));
+			};
+
+			for(auto mode : { GolombCoding::INTERLEAVED, GolombCoding::SIGN_MAGNITUDE }) {
+				string mode_name = mode == GolombCoding::INTERLEAVED ? "interleaved" : "sign_magnitude";
+				GolombCostModel costs { mode };
+				vector<unsigned> estimated(n_blocks), exact(n_blocks);
+
+				double est = best_time(opt.repeats, [&] {
+					for(size_t i = 0 ; i < n_blocks ; ++i)
+						estimated[i] = GolombCostModel::estimateFromMean(block(i), false);
+				});
+
+				double exa = best_time(opt.repeats, [&] {
+					for(size_t i = 0 ; i < n_blocks ; ++i) {
+						costs.reset();
+						costs.addBlock(block(i));
+						exact[i] = costs.bestParameter(false);
+					}
+				});
+
+				// Coded size with the chosen parameters, as the codecs write the blocks
+				auto coded_bytes = [&](const vector<unsigned>& ms) {
+					buf.clear();
+					MemorySink sink { buf };
+					BitStream bs { sink };
+					for(size_t i = 0 ; i < n_blocks ; ++i)
+						GolombCoding { ms[i], mode }.encodeBlock(block(i), bs);
+					bs.close();
+					return buf.size();
+				};
+				size_t est_bytes = coded_bytes(estimated);
+				size_t exa_bytes = coded_bytes(exact);
+
+				if(exa_bytes > est_bytes) {
+					cerr << "WORSE: " << distribution << " scale " << scale << ' ' << mode_name << '\n';
+					ok = false;
+				}
+
+				print_row("selector", "estimate", distribution, scale, mode_name, 0, residuals.size(), est_bytes, est);
+				print_row("selector", "exact", distribution, scale, mode_name, 0, residuals.size(), exa_bytes, exa);
+			}
+		}
+
+	return ok;
+}
+
+//------------------------------------------------------------------------------
+
+static vector<double> parse_list(const char* s) {
+	vector<double> v;
+	for(string item ; *s ; ) {
+		const char* comma = strchr(s, ',');
+		item.assign(s, comma ? comma : s + strlen(s));
+		v.push_back(stod(item));
+		s = comma ? comma + 1 : s + strlen(s);
+	}
+
+	return v;
+}
+
+static void usage() {
+	cerr << "Usage: bench_entropy [-n samples] [-r repeats] [-s scale,...] [-m m,...] [-b block]\n"
+		 << "                     [-t golomb|bitstream|selector]\n";
+}
+
+int main(int argc, char* argv[]) {
+	Options opt;
+	string only;
+
+	try {
+		for(int i = 1 ; i < argc ; ++i) {
+			string arg = argv[i];
+			if(i + 1 >= argc) {
+				usage();
+				return 1;
+			}
+			if(arg == "-n")
+				opt.samples = stoul(argv[++i]);
+			else if(arg == "-r")
+				opt.repeats = stoi(argv[++i]);
+			else if(arg == "-s")
+				opt.scales = parse_list(argv[++i]);
+			else if(arg == "-m") {
+				opt.ms.clear();
+				for(double m : parse_list(argv[++i]))
+					opt.ms.push_back(unsigned(m));
+			} else if(arg == "-b")
+				opt.block = stoul(argv[++i]);
+			else if(arg == "-t")
+				only = argv[++i];
+			else {
+				usage();
+				return 1;
+			}
+		}
+	} catch(const logic_error&) { // stoul/stod on a bad number
+		usage();
+		return 1;
+	}
+
+	if(opt.samples == 0 || opt.repeats < 1 || opt.block == 0 || find(opt.ms.begin(), opt.ms.end(), 0u) != opt.ms.end()) {
+		usage();
+		return 1;
+	}
+
+	bool ok = true;
+	print_header();
+	if(only.empty() || only == "golomb")
+		ok &= bench_golomb(opt);
+	if(only.empty() || only == "bitstream")
+		ok &= bench_bit_stream(opt);
+	if(only.empty() || only == "selector")
+		ok &= bench_selector(opt);
+
+	return ok ? 0 : 1;
+}
@@ -16,6 +16,7 @@
 //
 //-------------------------------------------------------------------------------------------
 
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <string>
@@ -25,32 +26,59 @@ using namespace std;
 
 BitStream::BitStream(fstream& fs, bool rw_status) : m_rw_status { rw_status },
   m_byte_stream { fs, rw_status } {
-	if(rw_status) {
-		m_bit_ptr = -1;
-	} else {
-		m_bit_ptr = 7;
-		m_buf = 0;
+}
+
+BitStream::BitStream(const string& path, bool rw_status, off_t offset) : m_rw_status { rw_status },
+  m_byte_stream { path, rw_status, offset } {
+}
+
+BitStream::BitStream(ByteSource& source) : m_rw_status { STREAM_READ }, m_byte_stream { source } {
+}
+
+BitStream::BitStream(ByteSink& sink) : m_rw_status { STREAM_WRITE }, m_byte_stream { sink } {
+}
+
+//-------------------------------------------------------------------------------------------
+//
+// Tops up the accumulator with as many whole bytes as fit (at least 57 valid bits
+// unless the end of the stream was reached)
+//
+void BitStream::refill() {
+	uint64_t w;
+	int n_bytes = m_byte_stream.get_word(w, (64 - m_acc_bits) / 8);
+
+	if(n_bytes > 0) {
+		m_acc |= w >> m_acc_bits;
+		m_acc_bits += 8 * n_bytes;
 	}
 }
 
 int BitStream::read_bit() {
-	if(--m_bit_ptr < 0) {
-		if((m_buf = m_byte_stream.get()) == EOF)
+	if(m_acc_bits == 0) {
+		refill();
+		if(m_acc_bits == 0)
 			return EOF;
-
-		m_bit_ptr = 7;
 	}
 
-	return (m_buf & (0x01 << m_bit_ptr)) >> m_bit_ptr;
+	int bit = m_acc >> 63;
+	m_acc <<= 1;
+	m_acc_bits--;
+
+	return bit;
 }
 
 uint64_t BitStream::read_n_bits(int n) {
-	uint64_t x { };
-	for(int i = 0 ; i < n ; ++i) {
-		x <<= 1;
-		x |= read_bit();
+	if(n <= 0)
+		return 0;
+
+	if(n > 57) { // More than a refill guarantees: split in two reads
+		uint64_t hi = read_n_bits(n - 32);
+		return (hi << 32) | read_n_bits(32);
 	}
 
+	uint64_t x = peek_bits(n);
+	consume_bits(n); // Past the end, zeros are read
+
 	return x;
 }
 
@@ -65,18 +93,34 @@ string BitStream::read_string() {
 }
 
 void BitStream::write_bit(int bit) {
-	if(m_bit_ptr < 0) {
-		m_byte_stream.put(m_buf);
-		m_bit_ptr = 7;
-		m_buf = 0;
-	}
+	m_acc |= uint64_t(bit & 0x01) << (63 - m_acc_bits);
 
-	m_buf |= (bit & 0x01) << m_bit_ptr--;
+	if(++m_acc_bits == 64) {
+		m_byte_stream.put_word(m_acc);
+		m_acc = 0;
+		m_acc_bits = 0;
+	}
 }
 
 void BitStream::write_n_bits(uint64_t bits, int n) {
-	for(int i = n - 1 ; i >= 0 ; i--)
-		write_bit(((0x01 << i) & bits) >> i);
+	if(n <= 0)
+		return;
+
+	if(n < 64)
+		bits &= (uint64_t(1) << n) - 1;
+
+	int free_bits = 64 - m_acc_bits;
+	if(n < free_bits) {
+		m_acc |= bits << (free_bits - n);
+		m_acc_bits += n;
+		return;
+	}
+
+	// The accumulator gets full: write it and keep what did not fit
+	int rest = n - free_bits;
+	m_byte_stream.put_word(m_acc | (bits >> rest));
+	m_acc = rest ? bits << (64 - rest) : 0;
+	m_acc_bits = rest;
 }
 
 void BitStream::write_string(const string& s) {
@@ -86,14 +130,110 @@ void BitStream::write_string(const string& s) {
 	write_n_bits('\n', 8); // Mark the end of the string with a newline
 }
 
+void BitStream::read_bytes(void* p, size_t n) {
+	uint8_t* bytes = static_cast<uint8_t*>(p);
+	if(m_acc_bits % 8 != 0) {
+		for(size_t i = 0 ; i < n ; ++i)
+			bytes[i] = read_n_bits(8);
+		return;
+	}
+
+	size_t i = 0;
+	for( ; i < n && m_acc_bits > 0 ; ++i) // Byte aligned: first the bytes already fetched
+		bytes[i] = read_n_bits(8);
+
+	size_t got = m_byte_stream.read(bytes + i, n - i);
+	fill(bytes + i + got, bytes + n, 0); // Past the end, zeros are read
+}
+
+void BitStream::write_bytes(const void* p, size_t n) {
+	const uint8_t* bytes = static_cast<const uint8_t*>(p);
+	if(m_acc_bits % 8 != 0) {
+		for(size_t i = 0 ; i < n ; ++i)
+			write_n_bits(bytes[i], 8);
+		return;
+	}
+
+	for( ; m_acc_bits > 0 ; m_acc_bits -= 8) { // Byte aligned: flush the whole bytes pending
+		m_byte_stream.put(m_acc >> 56);
+		m_acc <<= 8;
+	}
+	m_acc = 0;
+	m_byte_stream.write(bytes, n);
+}
+
+void BitStream::write_bits(const void* p, uint64_t n) {
+	const uint8_t* bytes = static_cast<const uint8_t*>(p);
+	for( ; n >= 64 ; n -= 64, bytes += 8) {
+		uint64_t w = 0;
+		for(int i = 0 ; i < 8 ; ++i)
+			w = (w << 8) | bytes[i];
+		write_n_bits(w, 64);
+	}
+
+	for( ; n >= 8 ; n -= 8)
+		write_n_bits(*bytes++, 8);
+
+	if(n > 0)
+		write_n_bits(*bytes >> (8 - n), n);
+}
+
 off_t BitStream::tell() {
-	return m_byte_stream.tell();
+	if(m_rw_status)
+		return m_byte_stream.tell() - m_acc_bits / 8; // Fetched but not yet used
+
+	return m_byte_stream.tell() + m_acc_bits / 8; // Complete but not yet flushed
+}
+
+uint64_t BitStream::tell_bits() {
+	if(m_rw_status)
+		return 8 * uint64_t(m_byte_stream.tell()) - m_acc_bits;
+
+	return 8 * uint64_t(m_byte_stream.tell()) + m_acc_bits;
+}
+
+void BitStream::seek_bits(uint64_t pos) {
+	if(not m_rw_status)
+		throw ios_base::failure("BitStream: cannot seek while writing");
+
+	uint64_t here = tell_bits();
+	if(pos >= here) { // Forward: no need for a seekable source
+		skip_bits(pos - here);
+		return;
+	}
+
+	m_byte_stream.seek(pos / 8);
+	m_acc = 0;
+	m_acc_bits = 0;
+	refill();
+	consume_bits(pos % 8);
+}
+
+void BitStream::skip_bits(uint64_t n) {
+	if(not m_rw_status)
+		throw ios_base::failure("BitStream: cannot skip while writing");
+
+	if(n < uint64_t(m_acc_bits)) { // Still in the accumulator
+		consume_bits(n);
+		return;
+	}
+
+	// Drop the accumulator and jump over the whole bytes that follow it
+	n -= m_acc_bits;
+	m_acc = 0;
+	m_acc_bits = 0;
+	m_byte_stream.skip(n / 8);
+	refill();
+	consume_bits(n % 8);
 }
 
 void BitStream::close() {
 	if(not m_rw_status) {
-		if(m_bit_ptr != 7) // Flush the bit buffer only if there are some bits there
-			m_byte_stream.put(m_buf);
+		for( ; m_acc_bits > 0 ; m_acc_bits -= 8) { // Flush the pending bits, zero padded
+			m_byte_stream.put(m_acc >> 56);
+			m_acc <<= 8;
+		}
+		m_acc_bits = 0;
 	}
 
 	m_byte_stream.close(); // Calls byte_stream flush if needed
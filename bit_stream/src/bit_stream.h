@@ -23,15 +23,29 @@
 #include <fstream>
 #include "byte_stream.h"
 
+//-------------------------------------------------------------------------------------------
+//
+// Bits are kept in a 64-bit accumulator, left aligned (the next bit to be read or
+// written is bit 63). Whole 64-bit words are exchanged with the ByteStream, so
+// read_n_bits/write_n_bits cost a few shifts instead of one call per bit. The
+// on-disk bit order is unchanged: most significant bit of each byte first.
+//
 class BitStream {
   private:
 	bool		m_rw_status { STREAM_READ };
-	int			m_buf;
-	int			m_bit_ptr;
+	uint64_t	m_acc { };
+	int			m_acc_bits { };	// Number of valid bits in m_acc
 	ByteStream	m_byte_stream;
 
+	void refill();
+
   public:
 	BitStream(std::fstream& fs, bool rw_status);
+	// Memory-mapped file (fstream fallback for pipes, "-" for stdin/stdout); see
+	// ByteStream for offset
+	BitStream(const std::string& path, bool rw_status, off_t offset = 0);
+	BitStream(ByteSource& source);
+	BitStream(ByteSink& sink);
 
 	BitStream() = delete;
 	BitStream(const BitStream&) = delete;
@@ -39,13 +53,46 @@ class BitStream {
 	BitStream& operator=(BitStream&&) = delete;
 	BitStream& operator=(const BitStream&) = delete;
 
+	// Look at the next n bits (1 <= n <= 57) without consuming them; past the
+	// end of the stream zeros are returned
+	uint64_t peek_bits(int n) {
+		if(m_acc_bits < n)
+			refill();
+
+		return m_acc >> (64 - n);
+	}
+
+	// Drop n bits (at most the number just peeked)
+	void consume_bits(int n) {
+		m_acc <<= n;
+		m_acc_bits = m_acc_bits > n ? m_acc_bits - n : 0;
+	}
+
+	bool end_of_stream() {
+		if(m_acc_bits == 0)
+			refill();
+
+		return m_acc_bits == 0;
+	}
+
 	int read_bit();
-	uint64_t read_n_bits(int n);
+	uint64_t read_n_bits(int n); // n <= 64
 	std::string read_string();
 	void write_bit(int bit);
-	void write_n_bits(uint64_t bits, int n);
+	void write_n_bits(uint64_t bits, int n); // n <= 64
 	void write_string(const std::string& s);
+	void read_bytes(void* p, size_t n);			// Raw bytes, in memory order
+	void write_bytes(const void* p, size_t n);
+	// The first n bits at p, in stream order (most significant bit of each byte
+	// first), at any bit position: e.g. bits coded into a MemorySink beforehand
+	void write_bits(const void* p, uint64_t n);
 	off_t tell();
+
+	// Bit positions, counted from the start of the stream. Seeking and skipping are
+	// for reading only; seeking backwards needs a seekable source (not a pipe).
+	uint64_t tell_bits();
+	void seek_bits(uint64_t pos);
+	void skip_bits(uint64_t n);
 	void close();
 };
 
@@ -0,0 +1,159 @@
+//------------------------------------------------------------------------------
+//
+// Throughput benchmark: word-level BitStream against the former bit-by-bit
+// implementation (kept here as LegacyBitStream, on top of the same ByteStream;
+// the only change is a 64-bit shift in write_n_bits, so widths above 31 work).
+//
+// Writes a stream of random-width fields with both engines, checks that the
+// files are byte-identical, reads them back with both and checks the values.
+// The files go to the system temporary directory unless a prefix is given.
+//
+//------------------------------------------------------------------------------
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <unistd.h>
+#include "bit_stream.h"
+
+using namespace std;
+
+//------------------------------------------------------------------------------
+
+class LegacyBitStream {
+  private:
+	int			m_buf { };
+	int			m_bit_ptr;
+	ByteStream	m_byte_stream;
+
+  public:
+	LegacyBitStream(fstream& fs, bool rw_status) : m_bit_ptr { rw_status ? -1 : 7 },
+	  m_byte_stream { fs, rw_status } { }
+
+	int read_bit() {
+		if(--m_bit_ptr < 0) {
+			if((m_buf = m_byte_stream.get()) == EOF)
+				return EOF;
+			m_bit_ptr = 7;
+		}
+		return (m_buf & (0x01 << m_bit_ptr)) >> m_bit_ptr;
+	}
+
+	uint64_t read_n_bits(int n) {
+		uint64_t x { };
+		for(int i = 0 ; i < n ; ++i) {
+			x <<= 1;
+			x |= read_bit();
+		}
+		return x;
+	}
+
+	void write_bit(int bit) {
+		if(m_bit_ptr < 0) {
+			m_byte_stream.put(m_buf);
+			m_bit_ptr = 7;
+			m_buf = 0;
+		}
+		m_buf |= (bit & 0x01) << m_bit_ptr--;
+	}
+
+	void write_n_bits(uint64_t bits, int n) {
+		for(int i = n - 1 ; i >= 0 ; i--)
+			write_bit((bits >> i) & 0x01);
+	}
+
+	void close(bool writing) {
+		if(writing && m_bit_ptr != 7)
+			m_byte_stream.put(m_buf);
+		m_byte_stream.close();
+	}
+};
+
+//------------------------------------------------------------------------------
+
+template<typename T>
+static double write_fields(const string& file, const vector<uint64_t>& values, const vector<int>& widths) {
+	fstream fs { file, ios::out | ios::binary | ios::trunc };
+	T bs { fs, STREAM_WRITE };
+
+	auto t0 = chrono::steady_clock::now();
+	for(size_t i = 0 ; i < values.size() ; ++i)
+		bs.write_n_bits(values[i], widths[i]);
+	if constexpr (is_same_v<T, BitStream>)
+		bs.close();
+	else
+		bs.close(true);
+	auto t1 = chrono::steady_clock::now();
+
+	return chrono::duration<double>(t1 - t0).count();
+}
+
+template<typename T>
+static double read_fields(const string& file, const vector<uint64_t>& values, const vector<int>& widths, bool& ok) {
+	fstream fs { file, ios::in | ios::binary };
+	T bs { fs, STREAM_READ };
+
+	ok = true;
+	auto t0 = chrono::steady_clock::now();
+	for(size_t i = 0 ; i < values.size() ; ++i)
+		ok &= bs.read_n_bits(widths[i]) == values[i];
+	auto t1 = chrono::steady_clock::now();
+
+	return chrono::duration<double>(t1 - t0).count();
+}
+
+static bool same_file(const string& a, const string& b) {
+	ifstream fa { a, ios::binary }, fb { b, ios::binary };
+	return vector<char>(istreambuf_iterator<char>(fa), { }) == vector<char>(istreambuf_iterator<char>(fb), { });
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+	size_t n_fields = argc > 1 ? stoul(argv[1]) : 10000000;
+	int max_width = argc > 2 ? stoi(argv[2]) : 24;
+	string base = argc > 3 ? argv[3]
+		: (filesystem::temp_directory_path() / ("bit_stream_bench." + to_string(getpid()))).string();
+
+	if(max_width < 1 || max_width > 57) {
+		cerr << "Usage: bit_stream_bench [n_fields] [max_width (1-57)] [tmp_file_prefix]\n";
+		return 1;
+	}
+
+	mt19937_64 rng { 12345 };
+	uniform_int_distribution<int> width_dist { 1, max_width };
+	vector<uint64_t> values(n_fields);
+	vector<int> widths(n_fields);
+	uint64_t total_bits = 0;
+	for(size_t i = 0 ; i < n_fields ; ++i) {
+		widths[i] = width_dist(rng);
+		values[i] = rng() & ((uint64_t(1) << widths[i]) - 1);
+		total_bits += widths[i];
+	}
+
+	string legacy_file = base + ".legacy", word_file = base + ".word";
+	double mb = total_bits / 8.0 / 1e6;
+	bool legacy_ok, word_ok;
+
+	double legacy_w = write_fields<LegacyBitStream>(legacy_file, values, widths);
+	double word_w = write_fields<BitStream>(word_file, values, widths);
+	double legacy_r = read_fields<LegacyBitStream>(legacy_file, values, widths, legacy_ok);
+	double word_r = read_fields<BitStream>(word_file, values, widths, word_ok);
+	bool identical = same_file(legacy_file, word_file);
+
+	remove(legacy_file.c_str());
+	remove(word_file.c_str());
+
+	cout << "fields: " << n_fields << ", widths 1-" << max_width << ", " << mb << " MB\n";
+	cout << "write  legacy: " << mb / legacy_w << " MB/s  word: " << mb / word_w << " MB/s  speedup: "
+		 << legacy_w / word_w << "x\n";
+	cout << "read   legacy: " << mb / legacy_r << " MB/s  word: " << mb / word_r << " MB/s  speedup: "
+		 << legacy_r / word_r << "x\n";
+	cout << "output identical: " << (identical ? "yes" : "NO") << ", read back: "
+		 << (legacy_ok && word_ok ? "ok" : "MISMATCH") << "\n";
+
+	return identical && legacy_ok && word_ok ? 0 : 1;
+}
@@ -0,0 +1,345 @@
+//-------------------------------------------------------------------------------------------
+//
+// Copyright 2025 University of Aveiro, Portugal, All Rights Reserved.
+//
+// These programs are supplied free of charge for research purposes only,
+// and may not be sold or incorporated into any commercial product. There is
+// ABSOLUTELY NO WARRANTY of any sort, nor any undertaking that they are
+// fit for ANY PURPOSE WHATSOEVER. Use them at your own risk. If you do
+// happen to find a bug, or have modifications to suggest, please report
+// the same to Armando J. Pinho, ap@ua.pt. The copyright notice above
+// and this statement of conditions must remain an integral part of each
+// and every copy made of these files.
+//
+// Armando J. Pinho (ap@ua.pt)
+// IEETA / DETI / University of Aveiro
+//
+//-------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "byte_io.h"
+
+using namespace std;
+
+const size_t MMAP_MIN_GROWTH = 1 << 20;		// A mapped output file grows by at least 1 MiB
+const size_t MEMORY_MIN_GROWTH = 1 << 16;	// ... and an output vector by at least 64 KiB
+
+//-------------------------------------------------------------------------------------------
+
+FstreamSource::FstreamSource(const string& path, off_t offset) : m_fs { m_own_fs } {
+	m_own_fs.open(path, ios::in | ios::binary);
+	if(not m_own_fs.is_open())
+		throw ios_base::failure("cannot open " + path);
+
+	m_own_fs.ignore(offset); // Works on pipes too
+	m_start = m_own_fs.tellg();
+}
+
+size_t FstreamSource::read(uint8_t* buf, size_t n) {
+	m_fs.read((char*)buf, n);
+	return m_fs.gcount();
+}
+
+bool FstreamSource::seek(uint64_t pos) {
+	if(m_start < 0)
+		return false;
+
+	m_fs.clear(); // A previous read may have hit the end
+	m_fs.seekg(m_start + streamoff(pos));
+	return not m_fs.fail();
+}
+
+FstreamSink::FstreamSink(const string& path, off_t offset) : m_fs { m_own_fs } {
+	m_own_fs.open(path, ios::out | ios::binary | (offset != 0 ? ios::app : ios::trunc));
+	if(not m_own_fs.is_open())
+		throw ios_base::failure("cannot open " + path);
+}
+
+void FstreamSink::write(const uint8_t* buf, size_t n) {
+	m_fs.write((const char*)buf, n);
+}
+
+//-------------------------------------------------------------------------------------------
+
+FdSource::FdSource(int fd, bool owned) : m_fd { fd }, m_owned { owned } {
+	m_start = lseek(fd, 0, SEEK_CUR);
+}
+
+size_t FdSource::read(uint8_t* buf, size_t n) {
+	size_t done = 0;
+	while(done < n) {
+		ssize_t r = ::read(m_fd, buf + done, n - done);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r < 0)
+			throw ios_base::failure(string("read: ") + strerror(errno));
+		if(r == 0)
+			break;
+		done += r;
+	}
+
+	return done;
+}
+
+bool FdSource::seek(uint64_t pos) {
+	return m_start >= 0 && lseek(m_fd, m_start + off_t(pos), SEEK_SET) >= 0;
+}
+
+void FdSource::close() {
+	if(m_owned && m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+}
+
+void FdSink::write(const uint8_t* buf, size_t n) {
+	while(n > 0) {
+		ssize_t w = ::write(m_fd, buf, n);
+		if(w < 0 && errno == EINTR)
+			continue;
+		if(w < 0)
+			throw ios_base::failure(string("write: ") + strerror(errno));
+		buf += w;
+		n -= w;
+	}
+}
+
+void FdSink::close() {
+	if(m_owned && m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+}
+
+//-------------------------------------------------------------------------------------------
+
+size_t MemorySource::read(uint8_t* buf, size_t n) {
+	n = min(n, m_size);
+	memcpy(buf, m_data, n);
+	m_data += n;
+	m_size -= n;
+	return n;
+}
+
+const uint8_t* MemorySource::borrow(size_t& n) {
+	const uint8_t* p = m_data;
+	n = m_size;
+	m_data += m_size;
+	m_size = 0;
+	return p;
+}
+
+bool MemorySource::seek(uint64_t pos) {
+	size_t total = (m_data - m_begin) + m_size;
+	if(pos > total)
+		return false;
+
+	m_data = m_begin + pos;
+	m_size = total - pos;
+	return true;
+}
+
+void MemorySink::write(const uint8_t* buf, size_t n) {
+	m_out.resize(m_used);
+	m_out.insert(m_out.end(), buf, buf + n);
+	m_used += n;
+}
+
+uint8_t* MemorySink::window(size_t& n) {
+	if(m_out.size() - m_used < MEMORY_MIN_GROWTH)
+		m_out.resize(max(2 * m_out.size(), m_used + MEMORY_MIN_GROWTH));
+
+	n = m_out.size() - m_used;
+	return m_out.data() + m_used;
+}
+
+void BufferSink::write(const uint8_t* buf, size_t n) {
+	if(n > m_capacity - m_used)
+		throw length_error("BufferSink: output buffer is full");
+
+	memcpy(m_buf + m_used, buf, n);
+	m_used += n;
+}
+
+uint8_t* BufferSink::window(size_t& n) {
+	if(m_used == m_capacity)
+		throw length_error("BufferSink: output buffer is full");
+
+	n = m_capacity - m_used;
+	return m_buf + m_used;
+}
+
+//-------------------------------------------------------------------------------------------
+
+MmapSource::MmapSource(const string& path, off_t offset) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0)
+		throw ios_base::failure("cannot open " + path);
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || not S_ISREG(st.st_mode) || st.st_size == 0 || offset > st.st_size) {
+		::close(fd);
+		throw ios_base::failure("cannot map " + path);
+	}
+
+	void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); // The mapping stays valid
+	if(p == MAP_FAILED)
+		throw ios_base::failure("cannot map " + path);
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+	m_map = static_cast<const uint8_t*>(p);
+	m_map_size = st.st_size;
+	m_start = m_pos = offset;
+}
+
+MmapSource::~MmapSource() {
+	close();
+}
+
+size_t MmapSource::read(uint8_t* buf, size_t n) {
+	n = min(n, m_map_size - m_pos);
+	memcpy(buf, m_map + m_pos, n);
+	m_pos += n;
+	return n;
+}
+
+const uint8_t* MmapSource::borrow(size_t& n) {
+	const uint8_t* p = m_map + m_pos;
+	n = m_map_size - m_pos;
+	m_pos = m_map_size;
+	return p;
+}
+
+bool MmapSource::seek(uint64_t pos) {
+	if(pos > m_map_size - m_start)
+		return false;
+
+	m_pos = m_start + pos;
+	return true;
+}
+
+void MmapSource::close() {
+	if(m_map != nullptr)
+		munmap(const_cast<uint8_t*>(m_map), m_map_size);
+	m_map = nullptr;
+}
+
+//-------------------------------------------------------------------------------------------
+
+MmapSink::MmapSink(const string& path, off_t offset) {
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+	if(fd < 0)
+		throw ios_base::failure("cannot open " + path);
+
+	struct stat st;
+	size_t size = offset + MMAP_MIN_GROWTH;
+	if(fstat(fd, &st) != 0 || not S_ISREG(st.st_mode) || offset > st.st_size || ftruncate(fd, size) != 0) {
+		::close(fd);
+		throw ios_base::failure("cannot map " + path);
+	}
+
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED) {
+		::close(fd);
+		throw ios_base::failure("cannot map " + path);
+	}
+
+	m_fd = fd;
+	m_map = static_cast<uint8_t*>(p);
+	m_map_size = size;
+	m_used = offset;
+}
+
+MmapSink::~MmapSink() {
+	try {
+		close();
+	} catch(const ios_base::failure&) {
+		// Nothing sensible to do here; call close() to see the error
+	}
+}
+
+void MmapSink::write(const uint8_t* buf, size_t n) {
+	while(n > 0) {
+		size_t room;
+		uint8_t* p = window(room);
+		size_t k = min(n, room);
+		memcpy(p, buf, k);
+		advance(k);
+		buf += k;
+		n -= k;
+	}
+}
+
+uint8_t* MmapSink::window(size_t& n) {
+	if(m_map_size - m_used < MMAP_MIN_GROWTH / 16) { // Running out of room: grow the file
+		size_t size = m_map_size + max(m_map_size, MMAP_MIN_GROWTH);
+		void* p = MAP_FAILED;
+		if(ftruncate(m_fd, size) == 0)
+			p = mremap(m_map, m_map_size, size, MREMAP_MAYMOVE);
+		if(p == MAP_FAILED)
+			throw ios_base::failure("cannot grow the mapped output file");
+
+		m_map = static_cast<uint8_t*>(p);
+		m_map_size = size;
+	}
+
+	n = m_map_size - m_used;
+	return m_map + m_used;
+}
+
+void MmapSink::close() {
+	if(m_map == nullptr)
+		return;
+
+	munmap(m_map, m_map_size);
+	m_map = nullptr;
+	int truncated = ftruncate(m_fd, m_used);
+	::close(m_fd);
+	m_fd = -1;
+
+	if(truncated != 0)
+		throw ios_base::failure("cannot set the output file size");
+}
+
+//-------------------------------------------------------------------------------------------
+
+unique_ptr<ByteSource> open_byte_source(const string& path, off_t offset) {
+	if(path == "-") {
+		if(offset != 0 && lseek(STDIN_FILENO, offset, SEEK_CUR) >= 0) // Redirected from a file
+			return make_unique<FdSource>(STDIN_FILENO);
+
+		auto source = make_unique<FdSource>(STDIN_FILENO);
+		uint8_t skip[4096];
+		for(off_t n = offset ; n > 0 ; ) { // A pipe cannot seek: read the bytes away
+			size_t got = source->read(skip, min<off_t>(n, sizeof skip));
+			if(got == 0)
+				break;
+			n -= got;
+		}
+		return source;
+	}
+
+	struct stat st;
+	if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		return make_unique<MmapSource>(path, offset);
+
+	return make_unique<FstreamSource>(path, offset);
+}
+
+unique_ptr<ByteSink> open_byte_sink(const string& path, off_t offset) {
+	if(path == "-")
+		return make_unique<FdSink>(STDOUT_FILENO);
+
+	struct stat st;
+	if(stat(path.c_str(), &st) != 0 || S_ISREG(st.st_mode))
+		return make_unique<MmapSink>(path, offset);
+
+	return make_unique<FstreamSink>(path, offset);
+}
+
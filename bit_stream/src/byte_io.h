@@ -0,0 +1,222 @@
+//-------------------------------------------------------------------------------------------
+//
+// Copyright 2025 University of Aveiro, Portugal, All Rights Reserved.
+//
+// These programs are supplied free of charge for research purposes only,
+// and may not be sold or incorporated into any commercial product. There is
+// ABSOLUTELY NO WARRANTY of any sort, nor any undertaking that they are
+// fit for ANY PURPOSE WHATSOEVER. Use them at your own risk. If you do
+// happen to find a bug, or have modifications to suggest, please report
+// the same to Armando J. Pinho, ap@ua.pt. The copyright notice above
+// and this statement of conditions must remain an integral part of each
+// and every copy made of these files.
+//
+// Armando J. Pinho (ap@ua.pt)
+// IEETA / DETI / University of Aveiro
+//
+//-------------------------------------------------------------------------------------------
+
+#ifndef BYTE_IO_H
+#define BYTE_IO_H
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+//-------------------------------------------------------------------------------------------
+//
+// Where a ByteStream gets its bytes from. Sources that hold all their data in memory
+// hand it over with borrow() and ByteStream reads it in place; the others are copied
+// through the ByteStream block buffer with read(). Positions given to seek() count
+// from the start of the data (after any offset given when opening).
+//
+class ByteSource {
+  public:
+	virtual ~ByteSource() = default;
+
+	// Copies up to n bytes into buf; returns how many (0 at the end of the source)
+	virtual size_t read(uint8_t* buf, size_t n) = 0;
+	// Hands over all the remaining bytes (n of them) without copying, or nullptr
+	virtual const uint8_t* borrow(size_t& n) { n = 0; return nullptr; }
+	// Next read() or borrow() starts at byte pos; false if the source cannot seek
+	virtual bool seek(uint64_t) { return false; }
+	virtual void close() { }
+};
+
+//-------------------------------------------------------------------------------------------
+//
+// Where a ByteStream puts its bytes. Sinks that own writable memory expose it with
+// window() and ByteStream writes there directly, reporting progress with advance();
+// the others receive the ByteStream block buffer with write().
+//
+class ByteSink {
+  public:
+	virtual ~ByteSink() = default;
+
+	virtual void write(const uint8_t* buf, size_t n) = 0;
+	// Writable memory right after the bytes written so far (n > 0 bytes), or nullptr
+	virtual uint8_t* window(size_t& n) { n = 0; return nullptr; }
+	// The first n bytes of the last window are now part of the output
+	virtual void advance(size_t) { }
+	virtual void close() { }
+};
+
+//-------------------------------------------------------------------------------------------
+
+class FstreamSource : public ByteSource {
+  private:
+	std::fstream	m_own_fs;
+	std::fstream&	m_fs;
+	std::streamoff	m_start;	// Where the data starts, for seek()
+
+  public:
+	FstreamSource(std::fstream& fs) : m_fs { fs }, m_start { fs.tellg() } { }
+	FstreamSource(const std::string& path, off_t offset = 0); // Skips the first offset bytes
+
+	size_t read(uint8_t* buf, size_t n) override;
+	bool seek(uint64_t pos) override;
+	void close() override { m_fs.close(); }
+};
+
+class FstreamSink : public ByteSink {
+  private:
+	std::fstream	m_own_fs;
+	std::fstream&	m_fs;
+
+  public:
+	FstreamSink(std::fstream& fs) : m_fs { fs } { }
+	FstreamSink(const std::string& path, off_t offset = 0); // Appends after offset bytes
+
+	void write(const uint8_t* buf, size_t n) override;
+	void close() override { m_fs.close(); }
+};
+
+//-------------------------------------------------------------------------------------------
+
+// Pipes and terminals cannot seek
+class FdSource : public ByteSource {
+  private:
+	int		m_fd;
+	bool	m_owned;
+	off_t	m_start;	// Where the data starts (-1 if the fd cannot seek)
+
+  public:
+	FdSource(int fd, bool owned = false);
+
+	size_t read(uint8_t* buf, size_t n) override;
+	bool seek(uint64_t pos) override;
+	void close() override;
+};
+
+class FdSink : public ByteSink {
+  private:
+	int		m_fd;
+	bool	m_owned;
+
+  public:
+	FdSink(int fd, bool owned = false) : m_fd { fd }, m_owned { owned } { }
+
+	void write(const uint8_t* buf, size_t n) override;
+	void close() override;
+};
+
+//-------------------------------------------------------------------------------------------
+
+class MemorySource : public ByteSource {
+  private:
+	const uint8_t*	m_begin;
+	const uint8_t*	m_data;
+	size_t			m_size;		// Bytes left from m_data
+
+  public:
+	MemorySource(const uint8_t* data, size_t size) : m_begin { data }, m_data { data }, m_size { size } { }
+	MemorySource(const std::vector<uint8_t>& v) : MemorySource(v.data(), v.size()) { }
+
+	size_t read(uint8_t* buf, size_t n) override;
+	const uint8_t* borrow(size_t& n) override;
+	bool seek(uint64_t pos) override;
+};
+
+// Appends to a vector, which is grown ahead and cut to the real size on close()
+class MemorySink : public ByteSink {
+  private:
+	std::vector<uint8_t>&	m_out;
+	size_t					m_used;
+
+  public:
+	MemorySink(std::vector<uint8_t>& out) : m_out { out }, m_used { out.size() } { }
+
+	void write(const uint8_t* buf, size_t n) override;
+	uint8_t* window(size_t& n) override;
+	void advance(size_t n) override { m_used += n; }
+	void close() override { m_out.resize(m_used); }
+};
+
+// Caller-supplied fixed buffer; throws std::length_error when it is full
+class BufferSink : public ByteSink {
+  private:
+	uint8_t*	m_buf;
+	size_t		m_capacity;
+	size_t		m_used { };
+
+  public:
+	BufferSink(uint8_t* buf, size_t capacity) : m_buf { buf }, m_capacity { capacity } { }
+
+	void write(const uint8_t* buf, size_t n) override;
+	uint8_t* window(size_t& n) override;
+	void advance(size_t n) override { m_used += n; }
+	size_t size() const { return m_used; }
+};
+
+//-------------------------------------------------------------------------------------------
+
+// Whole file mapped read-only, data starting offset bytes in
+class MmapSource : public ByteSource {
+  private:
+	const uint8_t*	m_map { };
+	size_t			m_map_size { };
+	size_t			m_start;
+	size_t			m_pos;
+
+  public:
+	MmapSource(const std::string& path, off_t offset = 0); // Throws if it cannot be mapped
+	~MmapSource() override;
+
+	size_t read(uint8_t* buf, size_t n) override;
+	const uint8_t* borrow(size_t& n) override;
+	bool seek(uint64_t pos) override;
+	void close() override;
+};
+
+// Keeps the first offset bytes of the file, grows it with ftruncate as it is written
+// and cuts it to the real length on close()
+class MmapSink : public ByteSink {
+  private:
+	uint8_t*	m_map { };
+	size_t		m_map_size { };
+	size_t		m_used;
+	int			m_fd { -1 };
+
+  public:
+	MmapSink(const std::string& path, off_t offset = 0); // Throws if it cannot be mapped
+	~MmapSink() override;
+
+	void write(const uint8_t* buf, size_t n) override;
+	uint8_t* window(size_t& n) override;
+	void advance(size_t n) override { m_used += n; }
+	void close() override;
+};
+
+//-------------------------------------------------------------------------------------------
+//
+// Open by path: "-" is stdin/stdout, regular files are memory mapped and anything
+// else (pipes, devices) goes through an fstream
+//
+std::unique_ptr<ByteSource> open_byte_source(const std::string& path, off_t offset = 0);
+std::unique_ptr<ByteSink> open_byte_sink(const std::string& path, off_t offset = 0);
+
+#endif
+
@@ -16,21 +16,95 @@
 //
 //-------------------------------------------------------------------------------------------
 
+#include <algorithm>
+#include <cstring>
 #include "byte_stream.h"
 
 using namespace std;
 
 //-------------------------------------------------------------------------------------------
 
-ByteStream::ByteStream(fstream& fs, bool rw_status) : m_rw_status { rw_status }, m_fs { fs } {
-	m_buf_limit = m_buf + BYTE_STREAM_BUF_SIZE;
-	if(m_rw_status) { // Open for reading
-		m_buf_ptr = m_buf_limit;
-		m_size = BYTE_STREAM_BUF_SIZE;
+ByteStream::ByteStream(fstream& fs, bool rw_status) : m_rw_status { rw_status } {
+	if(m_rw_status)
+		m_own_source = make_unique<FstreamSource>(fs);
+	else
+		m_own_sink = make_unique<FstreamSink>(fs);
+
+	m_source = m_own_source.get();
+	m_sink = m_own_sink.get();
+	init();
+}
+
+ByteStream::ByteStream(const string& path, bool rw_status, off_t offset) : m_rw_status { rw_status } {
+	if(m_rw_status)
+		m_own_source = open_byte_source(path, offset);
+	else
+		m_own_sink = open_byte_sink(path, offset);
+
+	m_source = m_own_source.get();
+	m_sink = m_own_sink.get();
+	init();
+}
+
+ByteStream::ByteStream(ByteSource& source) : m_rw_status { STREAM_READ }, m_source { &source } {
+	init();
+}
+
+ByteStream::ByteStream(ByteSink& sink) : m_rw_status { STREAM_WRITE }, m_sink { &sink } {
+	init();
+}
+
+void ByteStream::init() {
+	if(m_rw_status) { // Open for reading: the first get() fills the buffer
+		m_buf_ptr = m_data_begin = m_data_end = m_buf_limit = m_buf;
+		return;
+	}
+
+	size_t n;
+	if((m_window = m_sink->window(n)) != nullptr) { // Write straight into the sink
+		m_buf_ptr = m_window;
+		m_buf_limit = m_window + n;
+	} else {
+		m_buf_ptr = m_buf;
+		m_buf_limit = m_buf + BYTE_STREAM_BUF_SIZE;
 	}
+}
 
-	else // Open for writing
+//---------------------------------------------------------------------------------
+//
+// Reading: gets the next block (or all the source, if it is in memory) and points
+// m_buf_ptr to it; false at the end of the stream
+//
+bool ByteStream::fill() {
+	size_t n_bytes;
+	const uint8_t* data = m_source->borrow(n_bytes);
+	if(data != nullptr) {
+		m_buf_ptr = const_cast<uint8_t*>(data); // Only read from
+	} else {
+		n_bytes = m_source->read(m_buf, BYTE_STREAM_BUF_SIZE);
 		m_buf_ptr = m_buf;
+	}
+
+	m_data_begin = m_buf_ptr;
+	m_data_end = m_buf_ptr + n_bytes;
+	return n_bytes != 0;
+}
+
+//---------------------------------------------------------------------------------
+//
+// Writing: the buffer (or sink window) is full; hand it over and get room for more
+//
+void ByteStream::drain() {
+	if(m_window == nullptr) {
+		m_sink->write(m_buf, m_buf_ptr - m_buf);
+		m_buf_ptr = m_buf;
+		return;
+	}
+
+	m_sink->advance(m_buf_ptr - m_window);
+	size_t n;
+	m_window = m_buf_ptr = m_sink->window(n);
+	m_buf_limit = m_window + n;
 }
 
 //---------------------------------------------------------------------------------
@@ -38,13 +112,11 @@ ByteStream::ByteStream(fstream& fs, bool rw_status) : m_rw_status { rw_status },
 // m_buf_ptr points to the next free buffer position
 //
 void ByteStream::put(int c) {
+	if(m_buf_ptr == m_buf_limit) // buffer is full: write it
+		drain();
+
 	*m_buf_ptr++ = c;
 	m_tell++;
-
-	if(m_buf_ptr == m_buf_limit) { // buffer is full: write it
-		m_fs.write((char*)m_buf, BYTE_STREAM_BUF_SIZE);
-		m_buf_ptr = m_buf;
-	}
 }
 
 //---------------------------------------------------------------------------------
@@ -52,30 +124,165 @@ void ByteStream::put(int c) {
 // m_buf_ptr points to the next buffer char
 //
 int ByteStream::get() {
-	if(m_buf_ptr == m_buf_limit) { // buffer is empty: get another block
-		m_fs.read((char*)m_buf, BYTE_STREAM_BUF_SIZE);
-		if((m_size = m_fs.gcount()) == 0)
-			return EOF;
-
-		m_buf_ptr = m_buf;
-	} else {
-		if(m_buf_ptr - m_buf == m_size)
-			return EOF;
-	}
+	if(m_buf_ptr == m_data_end && not fill()) // buffer is empty: get another block
+		return EOF;
 
 	m_tell++;
 	return *m_buf_ptr++;
 }
 
+//---------------------------------------------------------------------------------
+//
+// Big-endian helpers for the word-level BitStream engine
+//
+static inline uint64_t load_be64(const uint8_t* p) {
+	uint64_t w;
+	memcpy(&w, p, sizeof w);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	return w;
+}
+
+static inline void store_be64(uint8_t* p, uint64_t w) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	w = __builtin_bswap64(w);
+#endif
+	memcpy(p, &w, sizeof w);
+}
+
+//---------------------------------------------------------------------------------
+//
+// Writes the 8 bytes of w, most significant byte first
+//
+void ByteStream::put_word(uint64_t w) {
+	if(m_buf_limit - m_buf_ptr >= 8) { // room for the whole word
+		store_be64(m_buf_ptr, w);
+		m_buf_ptr += 8;
+		m_tell += 8;
+		return;
+	}
+
+	for(int i = 56 ; i >= 0 ; i -= 8)
+		put((w >> i) & 0xff);
+}
+
+//---------------------------------------------------------------------------------
+//
+// Reads up to n_bytes (1 to 8) bytes into the most significant end of w and
+// returns how many were actually available
+//
+int ByteStream::get_word(uint64_t& w, int n_bytes) {
+	if(m_data_end - m_buf_ptr >= 8) {
+		w = load_be64(m_buf_ptr);
+		if(n_bytes < 8)
+			w &= ~(~uint64_t(0) >> (8 * n_bytes));
+
+		m_buf_ptr += n_bytes;
+		m_tell += n_bytes;
+		return n_bytes;
+	}
+
+	w = 0;
+	int n = 0;
+	for(int c ; n < n_bytes && (c = get()) != EOF ; ++n)
+		w |= uint64_t(c) << (56 - 8 * n);
+
+	return n;
+}
+
+//---------------------------------------------------------------------------------
+//
+// Block copies, for byte-aligned data such as already encoded frames
+//
+void ByteStream::write(const uint8_t* p, size_t n) {
+	while(n > 0) {
+		if(m_buf_ptr == m_buf_limit)
+			drain();
+
+		size_t k = min<size_t>(n, m_buf_limit - m_buf_ptr);
+		memcpy(m_buf_ptr, p, k);
+		m_buf_ptr += k;
+		m_tell += k;
+		p += k;
+		n -= k;
+	}
+}
+
+size_t ByteStream::read(uint8_t* p, size_t n) {
+	size_t done = 0;
+	while(done < n) {
+		if(m_buf_ptr == m_data_end && not fill())
+			break;
+
+		size_t k = min<size_t>(n - done, m_data_end - m_buf_ptr);
+		memcpy(p + done, m_buf_ptr, k);
+		m_buf_ptr += k;
+		m_tell += k;
+		done += k;
+	}
+
+	return done;
+}
+
+//---------------------------------------------------------------------------------
+//
+// Jumps over whole blocks without looking at them (stops at the end of the stream)
+//
+void ByteStream::skip(uint64_t n_bytes) {
+	while(true) {
+		uint64_t available = m_data_end - m_buf_ptr;
+		if(n_bytes <= available) {
+			m_buf_ptr += n_bytes;
+			m_tell += n_bytes;
+			return;
+		}
+
+		m_tell += available;
+		n_bytes -= available;
+		m_buf_ptr = m_data_end;
+		if(not fill())
+			return;
+	}
+}
+
+//---------------------------------------------------------------------------------
+//
+// pos counts from the start of the stream, like tell()
+//
+void ByteStream::seek(off_t pos) {
+	if(not m_rw_status)
+		throw ios_base::failure("ByteStream: cannot seek while writing");
+
+	off_t block_start = m_tell - (m_buf_ptr - m_data_begin);
+	if(pos >= block_start && pos <= m_tell + (m_data_end - m_buf_ptr)) { // Within this block
+		m_buf_ptr = m_data_begin + (pos - block_start);
+		m_tell = pos;
+		return;
+	}
+
+	if(pos < 0 || not m_source->seek(pos))
+		throw ios_base::failure("ByteStream: the source cannot seek");
+
+	m_buf_ptr = m_data_begin = m_data_end = m_buf;
+	m_tell = pos;
+}
+
 //---------------------------------------------------------------------------------
 //
 // m_buf_ptr points to a free buffer position
 //
 void ByteStream::flush() {
+	if(m_window != nullptr) { // Already in the sink memory: just account for it
+		m_sink->advance(m_buf_ptr - m_window);
+		m_window = m_buf_ptr;
+		return;
+	}
+
 	size_t n_bytes_to_write = m_buf_ptr - m_buf;
 
 	if(n_bytes_to_write != 0) { // If buf is not empty
-		m_fs.write((char*)m_buf, n_bytes_to_write);
+		m_sink->write(m_buf, n_bytes_to_write);
 		m_buf_ptr = m_buf;
 	}
 }
@@ -89,11 +296,11 @@ off_t ByteStream::tell() {
 //---------------------------------------------------------------------------------
 
 void ByteStream::close() {
-	if(not m_rw_status)
+	if(not m_rw_status) {
 		this->flush();
-
-	m_fs.close();
+		m_sink->close();
+	} else
+		m_source->close();
 }
 
 //---------------------------------------------------------------------------------
-
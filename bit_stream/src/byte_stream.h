@@ -20,24 +20,47 @@
 #define BYTE_STREAM_H
 
 #include <fstream>
+#include <memory>
+#include <string>
 #include <cstdint>
+#include <sys/types.h>
+#include "byte_io.h"
 
 const int BYTE_STREAM_BUF_SIZE = 65536;
 const bool STREAM_READ = true;
 const bool STREAM_WRITE = false;
 
+//-------------------------------------------------------------------------------------------
+//
+// Block-buffered bytes over a ByteSource (reading) or a ByteSink (writing); see
+// byte_io.h. With in-memory sources and sinks (memory, mmap) m_buf_ptr/m_buf_limit
+// point straight into their memory and m_buf is not used.
+//
 class ByteStream {
   private:
 	uint8_t			m_buf[BYTE_STREAM_BUF_SIZE];
 	uint8_t*		m_buf_ptr;
-	uint8_t*		m_buf_limit;
-	int				m_size;
+	uint8_t*		m_buf_limit;	// End of the buffer (writing)
+	uint8_t*		m_data_begin;	// Start of the valid data (reading)
+	uint8_t*		m_data_end;		// End of the valid data (reading)
+	uint8_t*		m_window { };	// Start of the sink window being written, if any
 	bool			m_rw_status { STREAM_READ };
 	off_t			m_tell { };
-	std::fstream&	m_fs;
+	ByteSource*		m_source { };
+	ByteSink*		m_sink { };
+	std::unique_ptr<ByteSource>	m_own_source;
+	std::unique_ptr<ByteSink>	m_own_sink;
+
+	void init();
+	bool fill();
+	void drain();
 
   public:
 	ByteStream(std::fstream& fs, bool rw_status);
+	// offset: bytes skipped (reading) or kept, e.g. a header, (writing) at the file start
+	ByteStream(const std::string& path, bool rw_status, off_t offset = 0);
+	ByteStream(ByteSource& source);
+	ByteStream(ByteSink& sink);
 
 	ByteStream() = delete;
 	ByteStream(const ByteStream&) = delete;
@@ -47,10 +70,17 @@ class ByteStream {
 
 	void put(int c);
 	int get();
+	void put_word(uint64_t w);
+	int get_word(uint64_t& w, int n_bytes);
+	void write(const uint8_t* p, size_t n);
+	size_t read(uint8_t* p, size_t n); // Returns how many bytes there were
+	// Reading only. skip() works on any source; seek() moves within the current
+	// block when it can and otherwise throws if the source cannot seek
+	void skip(uint64_t n_bytes);
+	void seek(off_t pos);
 	void flush();
 	off_t tell();
 	void close();
 };
 
 #endif
-
@@ -0,0 +1,506 @@
+#include "gimg.h"
+#include "profile.h"
+#include "thread_pool.h"
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <future>
+#include <stdexcept>
+#include <type_traits>
+
+namespace gimg {
+
+// Value of the header adaptive field for a per-sample m (-a); 0 is a fixed m and 1 one
+// m per block, sent before it
+const int ADAPTIVE_PER_SAMPLE = 2;
+
+// Mapped residual the per-sample Golomb parameter starts from: twice the JPEG-LS
+// initial magnitude, (range + 32) / 64, for 8-bit pixels
+const unsigned int RICE_INITIAL_MEAN = 8;
+
+// Prediction of the pixel at (row, col) of an image width pixels wide, from those above
+// and to its left (128 outside the image). clamped: as of version 3 (see below).
+int predict(const uint8_t* pixels, int width, int row, int col, PredictorType predictor, bool clamped) {
+    const uint8_t* at = pixels + static_cast<size_t>(row) * width + col;
+    int left = (col > 0) ? at[-1] : 128;
+    int top = (row > 0) ? at[-width] : 128;
+    int topLeft = (row > 0 && col > 0) ? at[-width - 1] : 128;
+    
+    switch (predictor) {
+        case PredictorType::LEFT:
+            return left;
+        
+        case PredictorType::TOP:
+            return top;
+        
+        case PredictorType::AVG:
+            return (left + top) / 2;
+        
+        case PredictorType::PAETH: {
+            int p = left + top - topLeft;
+            int pa = std::abs(p - left);
+            int pb = std::abs(p - top);
+            int pc = std::abs(p - topLeft);
+            
+            if (pa <= pb && pa <= pc) return left;
+            else if (pb <= pc) return top;
+            else return topLeft;
+        }
+        
+        // These two range over [-127, 382]; a prediction outside [0, 255] only makes the
+        // residual longer, so from version 3 it is clamped, and every residual is in
+        // [-255, 255]
+        case PredictorType::A_PLUS_HALF_B_MINUS_C: {
+            int prediction = left + (top - topLeft) / 2;
+            return clamped ? std::clamp(prediction, 0, 255) : prediction;
+        }
+        
+        case PredictorType::B_PLUS_HALF_A_MINUS_C: {
+            int prediction = top + (left - topLeft) / 2;
+            return clamped ? std::clamp(prediction, 0, 255) : prediction;
+        }
+        
+        default:
+            return 128;
+    }
+}
+
+// Golomb parameter giving the fewest bits for the residuals, from their exact coded
+// length under each candidate (see GolombCostModel). With riceOnly, m is a power of two.
+unsigned int selectGolombParameter(const std::vector<int>& residuals, bool riceOnly, GolombCostModel& costs) {
+    PROFILE_SCOPE(PARAMETERS);
+    costs.reset();
+    costs.addBlock(residuals);
+    return costs.bestParameter(riceOnly);
+}
+
+// Codes stripes (see STRIPES), or a whole image, one at a time: into a BitStream, or into
+// bytes. All buffers are kept for the next one.
+struct StripeEncoder {
+    EncoderConfig config;
+    std::vector<int> residuals;         // Of the block being coded
+    std::vector<int> rowResiduals;
+    GolombCostModel costs;
+    std::vector<uint8_t> bytes;
+    CodingStats stats;
+    
+    explicit StripeEncoder(const EncoderConfig& config) : config(config), costs(config.negativeMode) {
+        residuals.reserve(BLOCK_SIZE);
+    }
+    
+    // The rows x width pixels at pixels, predicted as a whole image
+    void encode(const uint8_t* pixels, int width, int rows, BitStream& bs) {
+        size_t totalPixels = static_cast<size_t>(width) * rows;
+        size_t pixelCount = 0;
+        residuals.clear();
+        rowResiduals.resize(width);
+        
+        // Per-pixel m: each residual is coded with the parameter those before it left
+        AdaptiveRice rice(RICE_INITIAL_MEAN);
+        GolombCoding adaptiveGolomb(1, config.negativeMode);
+        adaptiveGolomb.setEscape(config.maxQuotient, ESCAPE_BITS);
+        
+        // Each row is predicted whole, then coded
+        for (int row = 0; row < rows; row++) {
+            {
+                PROFILE_SCOPE(PREDICTION);
+                const uint8_t* line = pixels + static_cast<size_t>(row) * width;
+                for (int col = 0; col < width; col++) {
+                    rowResiduals[col] = static_cast<int>(line[col]) - predict(pixels, width, row, col, config.predictor, true);
+                }
+            }
+            
+            if (config.perSampleM) {
+                PROFILE_SCOPE(ENTROPY);
+                for (int residual : rowResiduals) {
+                    adaptiveGolomb.encodeAdaptive(residual, rice, bs);
+                }
+                continue;
+            }
+            
+            for (int residual : rowResiduals) {
+                residuals.push_back(residual);
+                pixelCount++;
+                
+                if (residuals.size() >= BLOCK_SIZE || pixelCount >= totalPixels) {
+                    unsigned int m = config.adaptiveM ? selectGolombParameter(residuals, config.riceOnly, costs)
+                                                      : config.fixedM;
+                    PROFILE_M(m);
+                    
+                    PROFILE_SCOPE(ENTROPY);
+                    bs.write_n_bits(m, 16);
+                    
+                    GolombCoding golomb(m, config.negativeMode);
+                    golomb.setEscape(config.maxQuotient, ESCAPE_BITS);
+                    golomb.encodeBlock(residuals, bs);
+                    
+                    stats.blocks++;
+                    stats.riceBlocks += golomb.isRice() ? 1 : 0;
+                    
+                    residuals.clear();
+                }
+            }
+        }
+    }
+    
+    // Same, into bytes, with stats of its own
+    void encode(const uint8_t* pixels, int width, int rows) {
+        bytes.clear();
+        stats = CodingStats();
+        MemorySink sink(bytes);
+        BitStream bs(sink);
+        encode(pixels, width, rows, bs);
+        bs.close();
+    }
+};
+
+Encoder::Encoder(const EncoderConfig& config, unsigned int threads) : config(config) {
+    if (config.stripeRows < 0) {
+        throw std::invalid_argument("invalid stripe height");
+    }
+    fileHeader.predictor = config.predictor;
+    fileHeader.adaptiveM = config.adaptiveM;
+    fileHeader.perSampleM = config.perSampleM;
+    fileHeader.fixedM = config.fixedM;
+    fileHeader.negativeMode = config.negativeMode;
+    fileHeader.maxQuotient = config.maxQuotient;
+    fileHeader.stripeRows = config.stripeRows;
+    
+    // Without stripes there is nothing to share among threads
+    if (threads > 1 && config.stripeRows > 0) {
+        pool = std::make_unique<ThreadPool>(threads);
+    }
+    size_t count = pool ? 2 * pool->size() : 1;
+    for (size_t i = 0; i < count; i++) {
+        slots.push_back(std::make_unique<StripeEncoder>(config));
+    }
+}
+
+Encoder::~Encoder() = default;
+
+// "GIMG", a zero, the version, then the fields, big-endian, 32 bits each; the unary
+// length limit (-q) shares the negative mode field, and the layout flags the predictor
+// field. With STRIPES, the stripe height follows.
+void Encoder::encode(const uint8_t* pixels, int width, int height, BitStream& bs) {
+    fileHeader.width = width;
+    fileHeader.height = height;
+    totals = CodingStats();
+    
+    bs.write_bytes("GIMG", 4);
+    
+    int stripeRows = config.stripeRows;
+    int predType = static_cast<int>(config.predictor) | (stripeRows > 0 ? STRIPES : 0);
+    int adaptive = config.perSampleM ? ADAPTIVE_PER_SAMPLE : config.adaptiveM ? 1 : 0;
+    int negMode = static_cast<int>(config.negativeMode) | static_cast<int>(config.maxQuotient << 8);
+    
+    bs.write_n_bits(0, 32);
+    bs.write_n_bits(static_cast<uint32_t>(fileHeader.version), 32);
+    bs.write_n_bits(static_cast<uint32_t>(width), 32);
+    bs.write_n_bits(static_cast<uint32_t>(height), 32);
+    bs.write_n_bits(static_cast<uint32_t>(predType), 32);
+    bs.write_n_bits(static_cast<uint32_t>(adaptive), 32);
+    bs.write_n_bits(config.fixedM, 32);
+    bs.write_n_bits(static_cast<uint32_t>(negMode), 32);
+    
+    if (stripeRows == 0) {
+        StripeEncoder& image = *slots[0];
+        image.stats = CodingStats();
+        image.encode(pixels, width, height, bs);
+        totals = image.stats;
+        return;
+    }
+    bs.write_n_bits(static_cast<uint32_t>(stripeRows), 32);
+    
+    // Stripes are coded in the slots, in turn (on the pool, if there is one), and written
+    // out in order, the oldest first when every slot is taken
+    std::deque<std::future<void>> pending;
+    size_t next = 0, oldest = 0;
+    std::vector<uint32_t> stripeBytes;
+    stripeBytes.reserve(fileHeader.numStripes());
+    
+    auto writeOldest = [&] {
+        if (pending.front().valid()) {
+            pending.front().get();
+        }
+        pending.pop_front();
+        const StripeEncoder& stripe = *slots[oldest];
+        oldest = (oldest + 1) % slots.size();
+        PROFILE_SCOPE(BIT_IO);
+        bs.write_bytes(stripe.bytes.data(), stripe.bytes.size());
+        stripeBytes.push_back(static_cast<uint32_t>(stripe.bytes.size()));
+        totals += stripe.stats;
+    };
+    
+    try {
+        for (int first = 0; first < height; first += stripeRows) {
+            StripeEncoder* stripe = slots[next].get();
+            next = (next + 1) % slots.size();
+            
+            auto job = [stripe, at = pixels + static_cast<size_t>(first) * width, width,
+                        rows = std::min(stripeRows, height - first)] {
+                stripe->encode(at, width, rows);
+            };
+            if (!pool) {
+                job();
+                pending.emplace_back(); // Nothing to wait for
+            } else {
+                pending.push_back(pool->submit(job));
+            }
+            if (pending.size() >= slots.size()) {
+                writeOldest();
+            }
+        }
+        while (!pending.empty()) {
+            writeOldest();
+        }
+    } catch (...) {
+        // The slots may still be in use
+        for (std::future<void>& job : pending) {
+            if (job.valid()) {
+                job.wait();
+            }
+        }
+        throw;
+    }
+    
+    PROFILE_SCOPE(BIT_IO);
+    for (uint32_t size : stripeBytes) {
+        bs.write_n_bits(size, 32);
+    }
+}
+
+void Encoder::encode(const uint8_t* pixels, int width, int height, std::vector<uint8_t>& bytes) {
+    MemorySink sink(bytes);
+    BitStream bs(sink);
+    encode(pixels, width, height, bs);
+    bs.close();
+}
+
+// The rows x width pixels of a stripe (or of the whole image) into pixels, which it is
+// predicted as if it were; residuals is a buffer for a row
+void decodeStripe(BitStream& bs, const GimgHeader& header, int rows, uint8_t* pixels, std::vector<int>& residuals) {
+    int width = header.width;
+    size_t pixelCount = 0;
+    GolombCoding golomb(1, header.negativeMode);
+    golomb.setEscape(header.maxQuotient, ESCAPE_BITS);
+    AdaptiveRice rice(RICE_INITIAL_MEAN);
+    residuals.resize(width);
+    
+    // Each row's residuals are read, then its pixels predicted from them
+    for (int row = 0; row < rows; row++) {
+        {
+            PROFILE_SCOPE(ENTROPY);
+            if (header.perSampleM) {
+                for (int col = 0; col < width; col++) {
+                    residuals[col] = golomb.decodeAdaptive(rice, bs);
+                }
+            } else {
+                // Blocks run on across rows, so the row is read in runs that end with a block
+                for (int col = 0; col < width;) {
+                    if (pixelCount % BLOCK_SIZE == 0) {
+                        golomb.setM(static_cast<unsigned int>(bs.read_n_bits(16)));
+                        PROFILE_M(golomb.getM());
+                    }
+                    size_t run = std::min<size_t>(width - col, BLOCK_SIZE - pixelCount % BLOCK_SIZE);
+                    golomb.decodeBlock(std::span<int>(residuals.data() + col, run), bs);
+                    col += static_cast<int>(run);
+                    pixelCount += run;
+                }
+            }
+        }
+        
+        PROFILE_SCOPE(PREDICTION);
+        uint8_t* line = pixels + static_cast<size_t>(row) * width;
+        for (int col = 0; col < width; col++) {
+            int prediction = predict(pixels, width, row, col, header.predictor, header.version >= 3);
+            line[col] = static_cast<uint8_t>(std::clamp(prediction + residuals[col], 0, 255));
+        }
+    }
+}
+
+Decoder::Decoder(unsigned int threads) {
+    if (threads > 1) {
+        pool = std::make_unique<ThreadPool>(threads);
+    }
+}
+
+Decoder::~Decoder() = default;
+
+const GimgHeader& Decoder::open(BitStream& bs) {
+    char magic[4];
+    bs.read_bytes(magic, 4);
+    if (std::string(magic, 4) != "GIMG") {
+        throw std::runtime_error("not a valid GIMG image file");
+    }
+    
+    // Version 1 starts with the width, native; a version 1 image of width 0 is told from
+    // a later version by the height that follows, which is then not one
+    fileHeader.version = 1;
+    bs.read_bytes(&fileHeader.width, sizeof(int));
+    if (fileHeader.width == 0) {
+        uint8_t next[4];
+        bs.read_bytes(next, 4);
+        uint32_t version = uint32_t(next[0]) << 24 | uint32_t(next[1]) << 16 | uint32_t(next[2]) << 8 | next[3];
+        if (version >= 2 && version <= GIMG_VERSION) {
+            fileHeader.version = static_cast<int>(version);
+            fileHeader.width = static_cast<int>(bs.read_n_bits(32));
+        } else {
+            std::memcpy(&fileHeader.height, next, sizeof(int));
+        }
+    }
+    
+    bool bigEndian = fileHeader.version >= 2;
+    auto field = [&](auto& value) {
+        if (bigEndian) {
+            value = static_cast<std::remove_reference_t<decltype(value)>>(bs.read_n_bits(32));
+        } else {
+            bs.read_bytes(&value, sizeof value);
+        }
+    };
+    
+    int predType, adaptive, negMode;
+    if (fileHeader.version != 1 || fileHeader.width != 0) {
+        field(fileHeader.height);
+    }
+    field(predType);
+    field(adaptive);
+    field(fileHeader.fixedM);
+    field(negMode);
+    
+    fileHeader.stripeRows = 0;
+    if ((predType & STRIPES) != 0) {
+        field(fileHeader.stripeRows);
+        if (fileHeader.stripeRows <= 0) {
+            throw std::runtime_error("corrupt GIMG header");
+        }
+    }
+    headerSize = static_cast<size_t>(bs.tell_bits() / 8);
+    
+    if (fileHeader.width < 0 || fileHeader.height < 0) {
+        throw std::runtime_error("corrupt GIMG header");
+    }
+    int predictor = predType & ~STRIPES;
+    int mode = negMode & 0xff;
+    if (predictor < 0 || predictor > static_cast<int>(PredictorType::B_PLUS_HALF_A_MINUS_C)
+        || (mode != GolombCoding::SIGN_MAGNITUDE && mode != GolombCoding::INTERLEAVED)) {
+        throw std::runtime_error("corrupt GIMG header");
+    }
+    fileHeader.predictor = static_cast<PredictorType>(predictor);
+    fileHeader.adaptiveM = adaptive != 0;
+    fileHeader.perSampleM = adaptive == ADAPTIVE_PER_SAMPLE;
+    fileHeader.negativeMode = static_cast<GolombCoding::NegativeMode>(mode);
+    fileHeader.maxQuotient = static_cast<unsigned int>(negMode) >> 8;
+    return fileHeader;
+}
+
+// Stripes one after the other, each from the byte after the last; the table of sizes at
+// the end is not needed
+void Decoder::decode(BitStream& bs, uint8_t* pixels) {
+    const GimgHeader& header = fileHeader;
+    if (header.stripeRows == 0) {
+        decodeStripe(bs, header, header.height, pixels, residuals);
+        return;
+    }
+    for (int first = 0; first < header.height; first += header.stripeRows) {
+        bs.skip_bits((8 - bs.tell_bits() % 8) % 8);
+        decodeStripe(bs, header, std::min(header.stripeRows, header.height - first),
+                     pixels + static_cast<size_t>(first) * header.width, residuals);
+    }
+}
+
+// With STRIPES, the stripes are located through the table of sizes (checked against the
+// data, with or without a pool) and decoded straight into their rows of pixels, each from
+// its own bytes, on the pool if there is one
+void Decoder::decode(const uint8_t* data, size_t size, uint8_t* pixels) {
+    const GimgHeader& header = fileHeader;
+    if (size < headerSize) {
+        throw std::runtime_error("corrupt GIMG header");
+    }
+    if (header.stripeRows == 0) {
+        MemorySource source(data + headerSize, size - headerSize);
+        BitStream bs(source);
+        decode(bs, pixels);
+        return;
+    }
+    
+    size_t numStripes = header.numStripes();
+    if ((size - headerSize) / sizeof(uint32_t) < numStripes) {
+        throw std::runtime_error("corrupt stripe table");
+    }
+    size_t tableOffset = size - numStripes * sizeof(uint32_t);
+    std::vector<size_t> offsets(numStripes + 1, headerSize);
+    {
+        PROFILE_SCOPE(BIT_IO);
+        std::vector<uint32_t> stripeBytes(numStripes);
+        if (header.version >= 2) {
+            MemorySource source(data + tableOffset, numStripes * sizeof(uint32_t));
+            BitStream table(source);
+            for (uint32_t& bytes : stripeBytes) {
+                bytes = static_cast<uint32_t>(table.read_n_bits(32));
+            }
+        } else {
+            std::memcpy(stripeBytes.data(), data + tableOffset, numStripes * sizeof(uint32_t));
+        }
+        for (size_t s = 0; s < numStripes; s++) {
+            offsets[s + 1] = offsets[s] + stripeBytes[s];
+        }
+    }
+    if (offsets[numStripes] != tableOffset) {
+        throw std::runtime_error("corrupt stripe table");
+    }
+    
+    if (!pool) {
+        for (size_t s = 0; s < numStripes; s++) {
+            int first = static_cast<int>(s) * header.stripeRows;
+            MemorySource source(data + offsets[s], offsets[s + 1] - offsets[s]);
+            BitStream bs(source);
+            decodeStripe(bs, header, std::min(header.stripeRows, header.height - first),
+                         pixels + static_cast<size_t>(first) * header.width, residuals);
+        }
+        return;
+    }
+    
+    std::vector<std::future<void>> jobs;
+    jobs.reserve(numStripes);
+    for (size_t s = 0; s < numStripes; s++) {
+        int first = static_cast<int>(s) * header.stripeRows;
+        jobs.push_back(pool->submit([stripeData = data + offsets[s], stripeSize = offsets[s + 1] - offsets[s],
+                                     rows = std::min(header.stripeRows, header.height - first),
+                                     at = pixels + static_cast<size_t>(first) * header.width, &header] {
+            MemorySource source(stripeData, stripeSize);
+            BitStream bs(source);
+            std::vector<int> row;
+            decodeStripe(bs, header, rows, at, row);
+        }));
+    }
+    // Every job is waited for before the first error is passed on
+    std::exception_ptr error;
+    for (std::future<void>& job : jobs) {
+        try {
+            job.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+const GimgHeader& Decoder::decode(const uint8_t* data, size_t size, std::vector<uint8_t>& pixels) {
+    {
+        MemorySource source(data, size);
+        BitStream bs(source);
+        open(bs);
+    }
+    pixels.resize(static_cast<size_t>(fileHeader.width) * fileHeader.height);
+    decode(data, size, pixels.data());
+    return fileHeader;
+}
+
+}
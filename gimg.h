@@ -0,0 +1,151 @@
+#ifndef GIMG_H
+#define GIMG_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "Golomb.h"
+#include "bit_stream/src/bit_stream.h"
+
+class ThreadPool;
+
+// Lossless grayscale image coding into GIMG files, for use in-process: Encoder and Decoder
+// work on 8-bit pixels in memory (row after row, width bytes each) and on BitStreams or
+// memory buffers, and keep their buffers from one image to the next. image_codec is a
+// command line on top of them.
+namespace gimg {
+
+enum class PredictorType {
+    LEFT = 0,           // left
+    TOP = 1,            // top
+    TOP_LEFT = 2,       // topLeft
+    AVG = 3,            // (left + top) / 2
+    PAETH = 4,          // (left + top - topLeft)
+    A_PLUS_HALF_B_MINUS_C = 5, // left + (top - topLeft) / 2
+    B_PLUS_HALF_A_MINUS_C = 6  // top + (left - topLeft) / 2
+};
+
+// Width of an escaped code (-q): predictions are kept to [0, 255] (see predict()), so
+// residuals of 8-bit pixels lie in [-255, 255] and their mapped values fit in 9 bits.
+// Before version 3 an escape that did not fit could not be encoded.
+const int ESCAPE_BITS = 9;
+
+// Pixels per block, each with its own m unless it adapts per pixel
+const size_t BLOCK_SIZE = 256;
+
+// Layout flag, kept in the predictor field of the header. STRIPES: the image is cut into
+// stripes of the header's stripe rows (the last may be shorter), each coded on its own:
+// predicted as if it were the whole image (128 above and to the left of it), with its
+// own blocks and per-pixel m, and starting on a byte boundary. The file then ends with
+// the size in bytes (uint32) of each stripe, so that stripes can be decoded in parallel.
+const int STRIPES = 0x100;
+
+// Version 1 files wrote the header, and the stripe table, in the writer's native byte
+// order; version 2, after a zero where version 1 has the width, writes them big-endian.
+// Version 3 clamps the a+(b-c)/2 and b+(a-c)/2 predictions to [0, 255].
+const int GIMG_VERSION = 3;
+
+// Fields of the GIMG header
+struct GimgHeader {
+    int version = GIMG_VERSION;
+    int width = 0;
+    int height = 0;
+    PredictorType predictor = PredictorType::PAETH;
+    bool adaptiveM = true;
+    bool perSampleM = false;
+    unsigned int fixedM = 16;
+    GolombCoding::NegativeMode negativeMode = GolombCoding::INTERLEAVED;
+    unsigned int maxQuotient = 0;
+    int stripeRows = 0;     // 0: one stripe, without the STRIPES layout
+
+    size_t numStripes() const {
+        return stripeRows > 0 ? (static_cast<size_t>(height) + stripeRows - 1) / stripeRows : 1;
+    }
+};
+
+// Encoder settings: the image_codec options, with their defaults
+struct EncoderConfig {
+    PredictorType predictor = PredictorType::PAETH;
+    bool adaptiveM = true;
+    bool perSampleM = false;
+    unsigned int fixedM = 16;
+    bool riceOnly = false;
+    GolombCoding::NegativeMode negativeMode = GolombCoding::INTERLEAVED;
+    unsigned int maxQuotient = 0;
+    int stripeRows = 0;     // Rows per stripe (see STRIPES); 0: the image as a whole
+};
+
+// Per-image coding counters, reported with the compression statistics
+struct CodingStats {
+    size_t blocks = 0;
+    size_t riceBlocks = 0;   // blocks whose m is a power of two (shift/mask path)
+
+    CodingStats& operator+=(const CodingStats& other) {
+        blocks += other.blocks;
+        riceBlocks += other.riceBlocks;
+        return *this;
+    }
+};
+
+struct StripeEncoder;
+
+// Encodes images into GIMG files. With stripes (EncoderConfig::stripeRows) and
+// threads > 1, the stripes are coded on a pool, at most two per thread in flight.
+class Encoder {
+public:
+    explicit Encoder(const EncoderConfig& config = EncoderConfig(), unsigned int threads = 1);
+    ~Encoder();
+
+    Encoder(const Encoder&) = delete;
+    Encoder& operator=(const Encoder&) = delete;
+
+    // The width x height pixels at pixels, as a GIMG file written to bs (not closed), or
+    // appended to bytes
+    void encode(const uint8_t* pixels, int width, int height, BitStream& bs);
+    void encode(const uint8_t* pixels, int width, int height, std::vector<uint8_t>& bytes);
+
+    const GimgHeader& header() const { return fileHeader; }
+    const CodingStats& stats() const { return totals; }    // Of the last image
+
+private:
+    EncoderConfig config;
+    GimgHeader fileHeader;
+    CodingStats totals;
+    std::vector<std::unique_ptr<StripeEncoder>> slots;     // Used in turn
+    std::unique_ptr<ThreadPool> pool;   // Last, so that its jobs end before the slots go
+};
+
+// Decodes GIMG files. From memory, the stripes of a file with the STRIPES layout are
+// found through its table of sizes and decoded on a pool when threads > 1; from a
+// BitStream (e.g. a pipe), one after the other.
+class Decoder {
+public:
+    explicit Decoder(unsigned int threads = 1);
+    ~Decoder();
+
+    Decoder(const Decoder&) = delete;
+    Decoder& operator=(const Decoder&) = delete;
+
+    // Reads the header at the start of bs; throws std::runtime_error if it is not a valid one
+    const GimgHeader& open(BitStream& bs);
+
+    // Once open() has read the header, the pixels (width x height of them) from bs, or
+    // from the size bytes at data (the whole file)
+    void decode(BitStream& bs, uint8_t* pixels);
+    void decode(const uint8_t* data, size_t size, uint8_t* pixels);
+
+    // A whole file held in memory, into pixels (resized to fit)
+    const GimgHeader& decode(const uint8_t* data, size_t size, std::vector<uint8_t>& pixels);
+
+    const GimgHeader& header() const { return fileHeader; }
+
+private:
+    GimgHeader fileHeader;
+    size_t headerSize = 0;
+    std::vector<int> residuals;         // Of the row being decoded, without a pool
+    std::unique_ptr<ThreadPool> pool;
+};
+
+}
+
+#endif
@@ -1,283 +1,287 @@
-#include "Golomb.h"
-#include "bit_stream/src/bit_stream.h"
+#include "gimg.h"
+#include "batch.h"
+#include "profile.h"
+#include "thread_pool.h"
 #include <opencv2/opencv.hpp>
 #include <iostream>
-#include <fstream>
 #include <string>
 #include <cstring>
 #include <vector>
 #include <cmath>
 #include <algorithm>
-#include <numeric>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
 
-enum class PredictorType {
-    LEFT = 0,           // left
-    TOP = 1,            // top
-    TOP_LEFT = 2,       // topLeft
-    AVG = 3,            // (left + top) / 2
-    PAETH = 4,          // (left + top - topLeft)
-    A_PLUS_HALF_B_MINUS_C = 5, // left + (top - topLeft) / 2
-    B_PLUS_HALF_A_MINUS_C = 6  // top + (left - topLeft) / 2
-};
+using namespace gimg;
 
-int predict(const cv::Mat& img, int row, int col, PredictorType predictor) {
-    int left = (col > 0) ? img.at<uint8_t>(row, col - 1) : 128;
-    int top = (row > 0) ? img.at<uint8_t>(row - 1, col) : 128;
-    int topLeft = (row > 0 && col > 0) ? img.at<uint8_t>(row - 1, col - 1) : 128;
-    
-    switch (predictor) {
-        case PredictorType::LEFT:
-            return left;
-            
-        case PredictorType::TOP:
-            return top;
-            
-        case PredictorType::AVG:
-            return (left + top) / 2;
-            
-        case PredictorType::PAETH: {
-            int p = left + top - topLeft;
-            int pa = std::abs(p - left);
-            int pb = std::abs(p - top);
-            int pc = std::abs(p - topLeft);
-            
-            if (pa <= pb && pa <= pc) return left;
-            else if (pb <= pc) return top;
-            else return topLeft;
-        }
-        
-        case PredictorType::A_PLUS_HALF_B_MINUS_C: {
-            return left + (top - topLeft) / 2;
-        }
+// Progress and statistics; sent to stderr when the GIMG side is stdout
+static std::ostream* info = &std::cout;
 
-        case PredictorType::B_PLUS_HALF_A_MINUS_C: {
-            return top + (left - topLeft) / 2;
-        }
-        
-        default:
-            return 128;
-    }
-}
-
-unsigned int estimateGolombParameter(const std::vector<int>& residuals) {
-    if (residuals.empty()) return 1;
-    
-    double mean = std::accumulate(residuals.begin(), residuals.end(), 0.0,
-                                  [](double sum, int r) { return sum + std::abs(r); }) 
-                  / residuals.size();
-    
-    if (mean < 0.5) return 1;
-    
-    double p = mean / (mean + 1.0);
-    unsigned int m = static_cast<unsigned int>(std::ceil(-1.0 / std::log2(p)));
-    return std::clamp(m, 1u, 65535u);
-}
+// With --stats=json, where the JSON report goes (where info would have; info goes nowhere)
+static std::ostream* report = nullptr;
+static std::ostream silent(nullptr);
 
 void printUsage(const char* progName) {
     std::cout << "Image Codec - Lossless grayscale image compression using Golomb coding\n\n"
               << "Usage:\n"
               << "  Encoding: " << progName << " -e [options] <input.pgm> <output.gimg>\n"
-              << "  Decoding: " << progName << " -d <input.gimg> <output.pgm>\n\n"
+              << "            " << progName << " -e [options] [-t <int>] --batch <dir|listfile> --out <dir>\n"
+              << "  Decoding: " << progName << " -d [-t <int>] [--stats=json] <input.gimg> <output.pgm>\n\n"
               << "Options:\n"
                  << "  -p <0-6>  Predictor:\n"
                  << "            0=Left, 1=Top, 2=Top-Left\n"
                  << "            3=Average, 4=Paeth [default]\n"
                  << "            5=a+(b-c)/2, 6=b+(a-c)/2\n"
               << "  -m <int>  Fixed Golomb m (default: adaptive)\n"
-              << "  -n <0-1>  Negative mode: 0=Interleaved [default], 1=Sign-Magnitude\n\n"
+              << "  -n <0-1>  Negative mode: 0=Interleaved [default], 1=Sign-Magnitude\n"
+              << "  -r        Restrict adaptive m to powers of two (faster Rice coding)\n"
+              << "  -a        Adapt m per pixel from the recent residuals, with nothing sent\n"
+              << "            (LOCO-I style; single pass, no block buffering)\n"
+              << "  -q <int>  Limit the unary part to q bits, escaping larger values (default: 0, no limit)\n"
+              << "  --batch <dir|listfile>\n"
+              << "            Encode every image (.pgm, .ppm, .png, ...) in dir, or every file listed\n"
+              << "            (one per line)\n"
+              << "  --out <dir>\n"
+              << "            Where --batch writes its .gimg files\n"
+              << "  -s <int>  Cut the image into stripes of this many rows, coded independently so that\n"
+              << "            they can be encoded and decoded in parallel (default: 0, no stripes)\n"
+              << "  -t <int>  Threads, 0 = all cores (default: 1): stripes coded at once, or with --batch,\n"
+              << "            images encoded at once; when decoding, stripes decoded at once\n"
+              << "  --stats=json\n"
+              << "            Report the statistics as JSON, with the time per stage and the m and\n"
+              << "            unary length histograms when built with PROFILE=1\n\n"
+              << "A GIMG file name of - reads from stdin or writes to stdout.\n\n"
               << "Examples:\n"
               << "  " << progName << " -e input.pgm output.gimg\n"
               << "  " << progName << " -e -n 1 input.pgm output.gimg  # use sign-magnitude\n"
               << "  " << progName << " -d output.gimg decoded.pgm\n";
 }
 
-bool encodeImage(const std::string& inputFile, const std::string& outputFile,
-                 PredictorType predictor, bool adaptiveM, unsigned int fixedM,
-                 GolombCoding::NegativeMode negativeMode) {
-    cv::Mat img = cv::imread(inputFile, cv::IMREAD_GRAYSCALE);
+bool encodeImage(const std::string& inputFile, const std::string& outputFile, const EncoderConfig& config,
+                 unsigned int threads) {
+    auto startTime = std::chrono::steady_clock::now();
+    cv::Mat img;
+    {
+        PROFILE_SCOPE(READ);
+        img = cv::imread(inputFile, cv::IMREAD_GRAYSCALE);
+    }
     if (img.empty()) {
         std::cerr << "Error: cannot read image file '" << inputFile << "'\n";
         return false;
     }
+    if (!img.isContinuous()) {
+        img = img.clone();
+    }
     
-    std::cout << "Input: " << img.cols << "x" << img.rows << " pixels, grayscale\n";
+    *info << "Input: " << img.cols << "x" << img.rows << " pixels, grayscale\n";
     
-    std::ofstream headerFile(outputFile, std::ios::binary | std::ios::trunc);
-    if (!headerFile.is_open()) {
+    // Memory-mapped (or stdout for "-"); the header goes through the same stream
+    std::unique_ptr<BitStream> out;
+    try {
+        out = std::make_unique<BitStream>(outputFile, STREAM_WRITE);
+    } catch (const std::ios_base::failure&) {
         std::cerr << "Error: cannot create output file\n";
         return false;
     }
+    BitStream& bs = *out;
     
-    headerFile.write("GIMG", 4);
-    
-    int width = img.cols;
-    int height = img.rows;
-    int predType = static_cast<int>(predictor);
-    int adaptive = adaptiveM ? 1 : 0;
-    int negMode = static_cast<int>(negativeMode);
-    
-    headerFile.write(reinterpret_cast<const char*>(&width), sizeof(int));
-    headerFile.write(reinterpret_cast<const char*>(&height), sizeof(int));
-    headerFile.write(reinterpret_cast<const char*>(&predType), sizeof(int));
-    headerFile.write(reinterpret_cast<const char*>(&adaptive), sizeof(int));
-    headerFile.write(reinterpret_cast<const char*>(&fixedM), sizeof(unsigned int));
-    headerFile.write(reinterpret_cast<const char*>(&negMode), sizeof(int));
-    
-    headerFile.close();
-    
-    std::fstream fs(outputFile, std::ios::binary | std::ios::in | std::ios::out | std::ios::ate);
-    BitStream bs(fs, false);
+    auto codingTime = std::chrono::steady_clock::now();
     
-    const size_t BLOCK_SIZE = 256;
-    size_t totalPixels = img.rows * img.cols;
-    size_t pixelCount = 0;
-    
-    std::vector<int> residuals;
-    residuals.reserve(BLOCK_SIZE);
-    
-    for (int row = 0; row < img.rows; row++) {
-        for (int col = 0; col < img.cols; col++) {
-            uint8_t pixel = img.at<uint8_t>(row, col);
-            int prediction = predict(img, row, col, predictor);
-            int residual = static_cast<int>(pixel) - prediction;
-            
-            residuals.push_back(residual);
-            pixelCount++;
-            
-            if (residuals.size() >= BLOCK_SIZE || pixelCount >= totalPixels) {
-                unsigned int m = adaptiveM ? estimateGolombParameter(residuals) : fixedM;
-                
-                bs.write_n_bits(m, 16);
-                
-                GolombCoding golomb(m, negativeMode);
-                for (int res : residuals) {
-                    std::vector<bool> encoded = golomb.encode(res);
-                    for (bool bit : encoded) {
-                        bs.write_bit(bit ? 1 : 0);
-                    }
-                }
-                
-                residuals.clear();
-            }
-        }
+    Encoder encoder(config, threads);
+    try {
+        encoder.encode(img.ptr<uint8_t>(), img.cols, img.rows, bs);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return false;
     }
+    const CodingStats& stats = encoder.stats();
     
-    bs.close();
+    {
+        PROFILE_SCOPE(WRITE);
+        bs.close();
+    }
     
+    auto endTime = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(endTime - codingTime).count();
     size_t originalSize = img.rows * img.cols;
     
-    std::ifstream compressed(outputFile, std::ios::binary | std::ios::ate);
-    size_t compressedSize = compressed.tellg();
-    compressed.close();
+    size_t compressedSize = bs.tell();
     
     double compressionRatio = static_cast<double>(originalSize) / compressedSize;
     double bitsPerPixel = (static_cast<double>(compressedSize) * 8.0) / (img.rows * img.cols);
     
-    std::cout << "\nCompression statistics:\n";
-    std::cout << "  Original size: " << originalSize << " bytes\n";
-    std::cout << "  Compressed size: " << compressedSize << " bytes\n";
-    std::cout << "  Compression ratio: " << compressionRatio << ":1\n";
-    std::cout << "  Bits per pixel: " << bitsPerPixel << "\n";
-    std::cout << "  Compression achieved: " 
-              << (100.0 * (1.0 - 1.0/compressionRatio)) << "%\n";
+    *info << "\nCompression statistics:\n";
+    *info << "  Original size: " << originalSize << " bytes\n";
+    *info << "  Compressed size: " << compressedSize << " bytes\n";
+    *info << "  Compression ratio: " << compressionRatio << ":1\n";
+    *info << "  Bits per pixel: " << bitsPerPixel << "\n";
+    *info << "  Compression achieved: " 
+          << (100.0 * (1.0 - 1.0/compressionRatio)) << "%\n";
+    if (!config.perSampleM) {
+        *info << "  Rice-coded blocks: " << stats.riceBlocks << "/" << stats.blocks
+              << " (" << (stats.blocks ? 100.0 * stats.riceBlocks / stats.blocks : 0.0) << "%)\n";
+    }
+    *info << "  Encoding time: " << seconds << " s ("
+          << (originalSize / 1e6) / seconds << " MB/s)\n";
+    
+    if (report != nullptr) {
+        double totalSeconds = std::chrono::duration<double>(endTime - startTime).count();
+        *report << "{\n  \"mode\": \"encode\",\n"
+                << "  \"input\": " << profile::jsonString(inputFile) << ",\n"
+                << "  \"output\": " << profile::jsonString(outputFile) << ",\n"
+                << "  \"width\": " << img.cols << ",\n"
+                << "  \"height\": " << img.rows << ",\n"
+                << "  \"original_bytes\": " << originalSize << ",\n"
+                << "  \"compressed_bytes\": " << compressedSize << ",\n"
+                << "  \"ratio\": " << compressionRatio << ",\n"
+                << "  \"bits_per_pixel\": " << bitsPerPixel << ",\n"
+                << "  \"seconds\": " << totalSeconds << ",\n"
+                << "  \"coding_seconds\": " << seconds << ",\n"
+                << "  \"mb_per_s\": " << (originalSize / 1e6) / seconds << ",\n"
+                << "  \"blocks\": " << stats.blocks << ",\n"
+                << "  \"rice_blocks\": " << stats.riceBlocks << ",\n"
+                << "  \"profile\": ";
+        profile::writeJson(*report, profile::total());
+        *report << "\n}\n";
+    }
     
     return true;
 }
 
-bool decodeImage(const std::string& inputFile, const std::string& outputFile) {
-    std::ifstream header(inputFile, std::ios::binary);
-    if (!header.is_open()) {
-        std::cerr << "Error: cannot open input file\n";
-        return false;
-    }
-    
-    char magic[4];
-    header.read(magic, 4);
-    if (std::string(magic, 4) != "GIMG") {
-        std::cerr << "Error: not a valid GIMG image file\n";
-        return false;
-    }
-    
-    int width, height, predType, adaptive, negMode;
-    unsigned int m;
-    
-    header.read(reinterpret_cast<char*>(&width), sizeof(int));
-    header.read(reinterpret_cast<char*>(&height), sizeof(int));
-    header.read(reinterpret_cast<char*>(&predType), sizeof(int));
-    header.read(reinterpret_cast<char*>(&adaptive), sizeof(int));
-    header.read(reinterpret_cast<char*>(&m), sizeof(unsigned int));
-    header.read(reinterpret_cast<char*>(&negMode), sizeof(int));
-    
-    PredictorType predictor = static_cast<PredictorType>(predType);
-    GolombCoding::NegativeMode negativeMode = static_cast<GolombCoding::NegativeMode>(negMode);
-    
-    header.close();
-    
-    std::cout << "Decoding: " << width << "x" << height << " pixels\n";
-    
-    std::fstream fs(inputFile, std::ios::binary | std::ios::in);
-    if (!fs.is_open()) {
-        std::cerr << "Error: cannot open input file\n";
-        return false;
+// Encodes a batch (see batch.h) on threads workers, each with an Encoder of its own
+int encodeBatch(const std::string& batch, const std::string& outDir, const EncoderConfig& config,
+                unsigned int threads) {
+    std::vector<std::string> inputs;
+    try {
+        inputs = batchInputs(batch, {".pgm", ".ppm", ".pbm", ".pnm", ".png", ".bmp", ".jpg", ".jpeg", ".tif", ".tiff"});
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
     }
+    *info << "Encoding " << inputs.size() << " image(s) to " << outDir << " (" << threads << " worker(s))...\n";
     
-    fs.seekg(4 + sizeof(int) * 5 + sizeof(unsigned int));
-    
-    BitStream bs(fs, true);
-    
-    cv::Mat img(height, width, CV_8UC1);
-    
-    const size_t BLOCK_SIZE = 256;
-    size_t pixelCount = 0;
+    std::vector<std::unique_ptr<Encoder>> encoders(threads);
     
-    for (int row = 0; row < height; row++) {
-        for (int col = 0; col < width; col++) {
-            if (pixelCount % BLOCK_SIZE == 0) {
-                m = static_cast<unsigned int>(bs.read_n_bits(16));
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<BatchResult> results;
+    try {
+        results = runBatch(inputs, outDir, ".gimg", threads, [&](unsigned int worker, BatchResult& result) {
+            if (!encoders[worker]) {
+                encoders[worker] = std::make_unique<Encoder>(config);
             }
             
-            GolombCoding golomb(m, negativeMode);
-            std::vector<bool> bits;
-            
-            char bit;
-            do {
-                bit = bs.read_bit();
-                bits.push_back(bit != 0);
-            } while (bit == 0);
-            
-            unsigned int b = static_cast<unsigned int>(std::floor(std::log2(m)));
-            unsigned int cutoff = (1 << (b + 1)) - m;
-            
-            for (unsigned int j = 0; j < b; j++) {
-                bits.push_back(bs.read_bit() != 0);
+            cv::Mat img;
+            {
+                PROFILE_SCOPE(READ);
+                img = cv::imread(result.input, cv::IMREAD_GRAYSCALE);
             }
-            
-            unsigned int r = 0;
-            for (unsigned int j = 0; j < b; j++) {
-                r = (r << 1) | (bits[bits.size() - b + j] ? 1 : 0);
+            if (img.empty()) {
+                throw std::runtime_error("cannot read image file");
             }
-            if (r >= cutoff) {
-                bits.push_back(bs.read_bit() != 0);
+            if (!img.isContinuous()) {
+                img = img.clone();
             }
             
-            auto [residual, bitsUsed] = golomb.decode(bits, 0);
-            
-            int prediction = predict(img, row, col, predictor);
-            int pixel = std::clamp(prediction + residual, 0, 255);
+            BitStream bs(result.output, STREAM_WRITE);
+            encoders[worker]->encode(img.ptr<uint8_t>(), img.cols, img.rows, bs);
+            {
+                PROFILE_SCOPE(WRITE);
+                bs.close();
+            }
             
-            img.at<uint8_t>(row, col) = static_cast<uint8_t>(pixel);
-            pixelCount++;
+            result.originalSize = static_cast<size_t>(img.rows) * img.cols;
+            result.compressedSize = bs.tell();
+        });
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    
+    printBatchSummary(report != nullptr ? *report : *info, results, seconds, threads, report != nullptr);
+    bool failed = std::any_of(results.begin(), results.end(), [](const BatchResult& result) {
+        return !result.error.empty();
+    });
+    return failed ? 1 : 0;
+}
+
+bool decodeImage(const std::string& inputFile, const std::string& outputFile, unsigned int threads) {
+    auto startTime = std::chrono::steady_clock::now();
+    
+    // A regular file is mapped whole, so that its stripes can be found through the table of
+    // sizes; stdin and pipes are decoded as they arrive
+    std::unique_ptr<MmapSource> map;
+    std::unique_ptr<MemorySource> mapped;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    if (inputFile != "-") {
+        PROFILE_SCOPE(READ);
+        try {
+            map = std::make_unique<MmapSource>(inputFile);
+            data = map->borrow(size);
+            mapped = std::make_unique<MemorySource>(data, size);
+        } catch (const std::ios_base::failure&) {
+            // Not mappable (empty, a FIFO, ...): read it as a stream
         }
     }
     
+    std::unique_ptr<BitStream> in;
+    try {
+        PROFILE_SCOPE(READ);
+        in = mapped ? std::make_unique<BitStream>(*mapped) : std::make_unique<BitStream>(inputFile, STREAM_READ);
+    } catch (const std::ios_base::failure&) {
+        std::cerr << "Error: cannot open input file\n";
+        return false;
+    }
+    BitStream& bs = *in;
+    
+    Decoder decoder(threads);
+    cv::Mat img;
+    try {
+        const GimgHeader& header = decoder.open(bs);
+        *info << "Decoding: " << header.width << "x" << header.height << " pixels";
+        if (header.stripeRows != 0) {
+            *info << ", " << header.numStripes() << " stripe(s) of " << header.stripeRows << " rows";
+        }
+        *info << "\n";
+        
+        img.create(header.height, header.width, CV_8UC1);
+        if (mapped) {
+            decoder.decode(data, size, img.ptr<uint8_t>());
+        } else {
+            decoder.decode(bs, img.ptr<uint8_t>());
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return false;
+    }
+    
     bs.close();
     
-    if (!cv::imwrite(outputFile, img)) {
-        std::cerr << "Error: cannot write output image\n";
-        return false;
+    {
+        PROFILE_SCOPE(WRITE);
+        if (!cv::imwrite(outputFile, img)) {
+            std::cerr << "Error: cannot write output image\n";
+            return false;
+        }
+    }
+    
+    if (report != nullptr) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        *report << "{\n  \"mode\": \"decode\",\n"
+                << "  \"input\": " << profile::jsonString(inputFile) << ",\n"
+                << "  \"output\": " << profile::jsonString(outputFile) << ",\n"
+                << "  \"width\": " << img.cols << ",\n"
+                << "  \"height\": " << img.rows << ",\n"
+                << "  \"seconds\": " << seconds << ",\n"
+                << "  \"mb_per_s\": " << (static_cast<double>(img.rows) * img.cols / 1e6) / seconds << ",\n"
+                << "  \"profile\": ";
+        profile::writeJson(*report, profile::total());
+        *report << "\n}\n";
     }
     
-    std::cout << "Decoding successful!\n";
+    *info << "Decoding successful!\n";
     return true;
 }
 
@@ -298,18 +302,47 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    bool jsonStats = false;
+    
     if (decodeMode) {
-        if (argc != 4) {
+        std::string inputFile, outputFile;
+        unsigned int threads = 1;
+        for (int i = 2; i < argc; i++) {
+            if (std::strcmp(argv[i], "--stats=json") == 0) {
+                jsonStats = true;
+            } else if (std::strcmp(argv[i], "-t") == 0) {
+                if (i + 1 >= argc) {
+                    std::cerr << "Error: -t requires a value\n";
+                    return 1;
+                }
+                int count = std::atoi(argv[++i]);
+                if (count < 0) {
+                    std::cerr << "Error: invalid thread count\n";
+                    return 1;
+                }
+                threads = count != 0 ? count : ThreadPool::hardwareThreads();
+            } else if (inputFile.empty()) {
+                inputFile = argv[i];
+            } else if (outputFile.empty()) {
+                outputFile = argv[i];
+            } else {
+                std::cerr << "Error: unexpected argument: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        
+        if (inputFile.empty() || outputFile.empty()) {
             std::cerr << "Error: decoding requires input and output files\n";
-            std::cerr << "Usage: " << argv[0] << " -d <input.gimg> <output.pgm>\n";
+            std::cerr << "Usage: " << argv[0] << " -d [-t <int>] [--stats=json] <input.gimg> <output.pgm>\n";
             return 1;
         }
+        if (jsonStats) {
+            report = info;
+            info = &silent;
+        }
         
-        std::string inputFile = argv[2];
-        std::string outputFile = argv[3];
-        
-        if (decodeImage(inputFile, outputFile)) {
-            std::cout << "Success!\n";
+        if (decodeImage(inputFile, outputFile, threads)) {
+            *info << "Success!\n";
             return 0;
         } else {
             std::cerr << "Decoding failed!\n";
@@ -317,10 +350,17 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    PredictorType predictor = PredictorType::PAETH;
-    bool adaptiveM = true;
-    unsigned int fixedM = 16;
-    GolombCoding::NegativeMode negativeMode = GolombCoding::INTERLEAVED;
+    EncoderConfig config;
+    PredictorType& predictor = config.predictor;
+    bool& adaptiveM = config.adaptiveM;
+    bool& perSampleM = config.perSampleM;
+    unsigned int& fixedM = config.fixedM;
+    bool& riceOnly = config.riceOnly;
+    GolombCoding::NegativeMode& negativeMode = config.negativeMode;
+    unsigned int& maxQuotient = config.maxQuotient;
+    int& stripeRows = config.stripeRows;
+    unsigned int threads = 1;
+    std::string batch, outDir;
     
     std::string inputFile, outputFile;
     
@@ -348,6 +388,10 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             adaptiveM = false;
+            perSampleM = false;
+        } else if (std::strcmp(argv[i], "-a") == 0) {
+            adaptiveM = true;
+            perSampleM = true;
         } else if (std::strcmp(argv[i], "-n") == 0) {
             if (i + 1 >= argc) {
                 std::cerr << "Error: -n requires a value\n";
@@ -362,6 +406,54 @@ int main(int argc, char* argv[]) {
                 std::cerr << "Error: invalid negative mode (must be 0 or 1)\n";
                 return 1;
             }
+        } else if (std::strcmp(argv[i], "-r") == 0) {
+            riceOnly = true;
+        } else if (std::strcmp(argv[i], "-q") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: -q requires a value\n";
+                return 1;
+            }
+            int limit = std::atoi(argv[++i]);
+            if (limit < 0 || limit > 0xffffff) {
+                std::cerr << "Error: invalid unary limit (must be 0-16777215)\n";
+                return 1;
+            }
+            maxQuotient = limit;
+        } else if (std::strcmp(argv[i], "-s") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: -s requires a value\n";
+                return 1;
+            }
+            stripeRows = std::atoi(argv[++i]);
+            if (stripeRows < 0) {
+                std::cerr << "Error: invalid stripe height\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--stats=json") == 0) {
+            jsonStats = true;
+        } else if (std::strcmp(argv[i], "--batch") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --batch requires a value\n";
+                return 1;
+            }
+            batch = argv[++i];
+        } else if (std::strcmp(argv[i], "--out") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: --out requires a value\n";
+                return 1;
+            }
+            outDir = argv[++i];
+        } else if (std::strcmp(argv[i], "-t") == 0) {
+            if (i + 1 >= argc) {
+                std::cerr << "Error: -t requires a value\n";
+                return 1;
+            }
+            int count = std::atoi(argv[++i]);
+            if (count < 0) {
+                std::cerr << "Error: invalid thread count\n";
+                return 1;
+            }
+            threads = count != 0 ? count : ThreadPool::hardwareThreads();
         } else {
             if (inputFile.empty()) {
                 inputFile = argv[i];
@@ -375,36 +467,60 @@ int main(int argc, char* argv[]) {
         i++;
     }
     
-    if (inputFile.empty() || outputFile.empty()) {
+    if (!batch.empty() || !outDir.empty()) {
+        if (batch.empty() || outDir.empty() || !inputFile.empty()) {
+            std::cerr << "Error: --batch and --out go together, without input and output files\n";
+            return 1;
+        }
+    } else if (inputFile.empty() || outputFile.empty()) {
         std::cerr << "Error: both input and output files must be specified\n";
         printUsage(argv[0]);
         return 1;
     }
+    if (outputFile == "-") {
+        info = &std::cerr;
+    }
+    if (jsonStats) {
+        report = info;
+        info = &silent;
+    }
     
-    std::cout << "Image Codec Configuration:\n";
-    std::cout << "  Predictor: ";
+    *info << "Image Codec Configuration:\n";
+    *info << "  Predictor: ";
     switch (predictor) {
-        case PredictorType::LEFT: std::cout << "Left\n"; break;
-        case PredictorType::TOP: std::cout << "Top\n"; break;
-        case PredictorType::TOP_LEFT: std::cout << "Top-Left\n"; break;
-        case PredictorType::AVG: std::cout << "Average\n"; break;
-        case PredictorType::PAETH: std::cout << "Paeth (PNG)\n"; break;
-        case PredictorType::A_PLUS_HALF_B_MINUS_C: std::cout << "a+(b-c)/2\n"; break;
-        case PredictorType::B_PLUS_HALF_A_MINUS_C: std::cout << "b+(a-c)/2\n"; break;
+        case PredictorType::LEFT: *info << "Left\n"; break;
+        case PredictorType::TOP: *info << "Top\n"; break;
+        case PredictorType::TOP_LEFT: *info << "Top-Left\n"; break;
+        case PredictorType::AVG: *info << "Average\n"; break;
+        case PredictorType::PAETH: *info << "Paeth (PNG)\n"; break;
+        case PredictorType::A_PLUS_HALF_B_MINUS_C: *info << "a+(b-c)/2\n"; break;
+        case PredictorType::B_PLUS_HALF_A_MINUS_C: *info << "b+(a-c)/2\n"; break;
     }
-    std::cout << "  Golomb parameter: ";
-    if (adaptiveM) {
-        std::cout << "Adaptive\n";
+    *info << "  Golomb parameter: ";
+    if (perSampleM) {
+        *info << "Adaptive per pixel\n";
+    } else if (adaptiveM) {
+        *info << (riceOnly ? "Adaptive (powers of two)\n" : "Adaptive\n");
     } else {
-        std::cout << "Fixed (m=" << fixedM << ")\n";
+        *info << "Fixed (m=" << fixedM << ")\n";
+    }
+    *info << "  Negative mode: " 
+          << (negativeMode == GolombCoding::INTERLEAVED ? "Interleaved" : "Sign-Magnitude") 
+          << "\n";
+    if (maxQuotient != 0) {
+        *info << "  Unary limit: " << maxQuotient << " (then " << ESCAPE_BITS << "-bit escape)\n";
+    }
+    if (stripeRows != 0) {
+        *info << "  Stripes: " << stripeRows << " rows\n";
+    }
+    *info << "\n";
+    if (!batch.empty()) {
+        return encodeBatch(batch, outDir, config, threads);
     }
-    std::cout << "  Negative mode: " 
-              << (negativeMode == GolombCoding::INTERLEAVED ? "Interleaved" : "Sign-Magnitude") 
-              << "\n";
-    std::cout << "\nEncoding " << inputFile << " to " << outputFile << "...\n\n";
+    *info << "Encoding " << inputFile << " to " << outputFile << "...\n\n";
     
-    if (encodeImage(inputFile, outputFile, predictor, adaptiveM, fixedM, negativeMode)) {
-        std::cout << "\nEncoding successful!\n";
+    if (encodeImage(inputFile, outputFile, config, threads)) {
+        *info << "\nEncoding successful!\n";
         return 0;
     } else {
         std::cerr << "\nEncoding failed!\n";
@@ -0,0 +1,183 @@
+#ifndef LPC_H
+#define LPC_H
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include "bit_stream/src/bit_stream.h"
+
+// Linear prediction with quantized coefficients: x[0] is predicted as
+// (coefs[0] * x[-order] + ... + coefs[order - 1] * x[-1]) >> shift. The coefficients are
+// kept oldest sample first, so that the dot product runs forward over both arrays and
+// the compiler vectorizes it. It is done in 32-bit modular arithmetic: the encoder keeps
+// the sum in range (see computeLpc), and a corrupt filter cannot cause undefined behaviour.
+struct LpcFilter {
+    static constexpr int MAX_ORDER = 32;
+    static constexpr int MAX_PRECISION = 15;   // Coefficient bits, sign included
+    static constexpr int MAX_SHIFT = 15;
+
+    int order = 0;      // 0: every prediction is 0
+    int precision = 0;
+    int shift = 0;
+    std::array<int32_t, MAX_ORDER> coefs{};
+
+    int32_t predict(const int32_t* x) const {
+        const int32_t* past = x - order;
+        uint32_t sum = 0;
+        for (int j = 0; j < order; j++) {
+            sum += static_cast<uint32_t>(coefs[j]) * static_cast<uint32_t>(past[j]);
+        }
+        return static_cast<int32_t>(sum) >> shift;
+    }
+
+    // 6-bit order, then (for order > 0) the precision less one in 4 bits, the shift in
+    // 4 bits and each coefficient in precision bits
+    void write(BitStream& bs) const {
+        bs.write_n_bits(order, 6);
+        if (order == 0) {
+            return;
+        }
+        bs.write_n_bits(precision - 1, 4);
+        bs.write_n_bits(shift, 4);
+        for (int j = 0; j < order; j++) {
+            bs.write_n_bits(static_cast<uint32_t>(coefs[j]) & ((1u << precision) - 1), precision);
+        }
+    }
+
+    void read(BitStream& bs) {
+        order = static_cast<int>(bs.read_n_bits(6));
+        if (order > MAX_ORDER) {
+            throw std::runtime_error("corrupt LPC filter");
+        }
+        precision = 0;
+        shift = 0;
+        if (order == 0) {
+            return;
+        }
+        precision = static_cast<int>(bs.read_n_bits(4)) + 1;
+        shift = static_cast<int>(bs.read_n_bits(4));
+        for (int j = 0; j < order; j++) {
+            uint32_t bits = static_cast<uint32_t>(bs.read_n_bits(precision));
+            coefs[j] = static_cast<int32_t>(bits << (32 - precision)) >> (32 - precision); // Sign extend
+        }
+    }
+};
+
+// Autocorrelation of the n samples of x under a Welch window, for lags 0 to maxLag
+inline std::vector<double> autocorrelation(const int32_t* x, size_t n, int maxLag) {
+    std::vector<double> w(n);
+    double half = (n + 1) / 2.0;
+    for (size_t i = 0; i < n; i++) {
+        double t = (i - (n - 1) / 2.0) / half;
+        w[i] = x[i] * (1.0 - t * t);
+    }
+    std::vector<double> r(maxLag + 1, 0.0);
+    for (int lag = 0; lag <= maxLag && static_cast<size_t>(lag) < n; lag++) {
+        double sum = 0.0;
+        for (size_t i = lag; i < n; i++) {
+            sum += w[i] * w[i - lag];
+        }
+        r[lag] = sum;
+    }
+    return r;
+}
+
+// Filter for the n samples of x: the autocorrelation goes through Levinson-Durbin, which
+// gives the predictor (and its error) of every order up to maxOrder; the order expected
+// to take the fewest bits, residuals and coefficients together, is quantized. The
+// precision is lowered until no prediction can leave 32 bits.
+inline LpcFilter computeLpc(const int32_t* x, size_t n, int maxOrder) {
+    LpcFilter filter;
+    maxOrder = std::clamp(maxOrder, 0, LpcFilter::MAX_ORDER);
+    if (n <= static_cast<size_t>(maxOrder)) {
+        maxOrder = static_cast<int>(n / 2);
+    }
+    if (maxOrder == 0) {
+        return filter;
+    }
+
+    std::vector<double> r = autocorrelation(x, n, maxOrder);
+    if (r[0] <= 0.0) {
+        return filter; // Silence
+    }
+
+    // lpc[m - 1] holds the order m predictor, a[0] weighting x[-1]
+    std::vector<std::vector<double>> lpc(maxOrder);
+    std::vector<double> a(maxOrder, 0.0), previous(maxOrder, 0.0);
+    double err = r[0];
+    int bestOrder = 0;
+    double bestBits = 0.5 * std::log2(std::max(err * 0.5 / n, 1.0)) * n;
+    for (int m = 1; m <= maxOrder; m++) {
+        double acc = r[m];
+        for (int j = 0; j < m - 1; j++) {
+            acc -= a[j] * r[m - 1 - j];
+        }
+        double k = acc / err;
+        previous = a;
+        for (int j = 0; j < m - 1; j++) {
+            a[j] = previous[j] - k * previous[m - 2 - j];
+        }
+        a[m - 1] = k;
+        err *= (1.0 - k * k);
+        lpc[m - 1].assign(a.begin(), a.begin() + m);
+        if (err <= 0.0) {
+            bestOrder = m;
+            break;
+        }
+
+        double bits = 0.5 * std::log2(std::max(err * 0.5 / n, 1.0)) * (n - m)
+                      + m * LpcFilter::MAX_PRECISION;
+        if (bits < bestBits) {
+            bestBits = bits;
+            bestOrder = m;
+        }
+    }
+    if (bestOrder == 0) {
+        return filter;
+    }
+
+    const std::vector<double>& best = lpc[bestOrder - 1];
+    double cmax = 0.0;
+    for (double c : best) {
+        cmax = std::max(cmax, std::abs(c));
+    }
+    if (cmax <= 0.0) {
+        return filter;
+    }
+
+    int32_t maxAbs = 0;
+    for (size_t i = 0; i < n; i++) {
+        maxAbs = std::max(maxAbs, std::abs(x[i]));
+    }
+
+    for (int precision = LpcFilter::MAX_PRECISION; precision >= 2; precision--) {
+        int exponent;
+        std::frexp(cmax, &exponent); // cmax < 2^exponent
+        int shift = std::clamp(precision - 1 - exponent, 0, LpcFilter::MAX_SHIFT);
+        int32_t qmax = (1 << (precision - 1)) - 1;
+
+        // Rounding with error feedback, so that the errors do not add up
+        filter.order = bestOrder;
+        filter.precision = precision;
+        filter.shift = shift;
+        double error = 0.0;
+        int64_t sumAbs = 0;
+        for (int j = 0; j < bestOrder; j++) {
+            error += best[j] * (1 << shift);
+            int32_t q = std::clamp(static_cast<int32_t>(std::lround(error)), -qmax - 1, qmax);
+            error -= q;
+            filter.coefs[bestOrder - 1 - j] = q;
+            sumAbs += std::abs(q);
+        }
+        if (sumAbs * maxAbs <= INT32_MAX) {
+            return filter;
+        }
+    }
+    return LpcFilter();
+}
+
+#endif
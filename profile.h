@@ -0,0 +1,229 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Hot-path instrumentation of the codecs: time spent in each stage of the pipeline, and
+// histograms of the Golomb parameters and unary run lengths coded. It is built in only
+// with CODEC_PROFILE defined (make PROFILE=1); otherwise PROFILE_SCOPE, PROFILE_M and
+// PROFILE_UNARY expand to nothing and total() is all zeros.
+//
+// Each thread counts into its own Counters, so the pool threads need no locking; total()
+// adds them up, and is meant to be called once the coding is over. A stage's time is
+// exclusive: a scope opened inside another one is taken out of the outer one's time.
+namespace profile {
+
+enum Stage {
+    READ,               // Input file
+    DECORRELATION,      // Stereo modes, channels split and joined
+    PREDICTION,         // Predictors chosen, fitted and applied
+    PARAMETERS,         // Golomb parameters chosen
+    ENTROPY,            // Codes written and read
+    BIT_IO,             // Coded frames moved between streams, seek table
+    WRITE,              // Output file
+    STAGES
+};
+
+inline const char* const STAGE_NAMES[STAGES] = {
+    "read", "decorrelation", "prediction", "parameters", "entropy", "bit_io", "write"
+};
+
+const int M_BUCKETS = 32;       // floor(log2(m))
+const int UNARY_BUCKETS = 33;   // Quotients 0 to 31, then 32 or more (escapes: the limit)
+
+struct Counters {
+    std::array<uint64_t, STAGES> nanoseconds{};
+    std::array<uint64_t, STAGES> calls{};
+    std::array<uint64_t, M_BUCKETS> mLog2{};
+    std::array<uint64_t, UNARY_BUCKETS> unary{};
+
+    Counters& operator+=(const Counters& other) {
+        for (int s = 0; s < STAGES; s++) {
+            nanoseconds[s] += other.nanoseconds[s];
+            calls[s] += other.calls[s];
+        }
+        for (int b = 0; b < M_BUCKETS; b++) {
+            mLog2[b] += other.mLog2[b];
+        }
+        for (int b = 0; b < UNARY_BUCKETS; b++) {
+            unary[b] += other.unary[b];
+        }
+        return *this;
+    }
+};
+
+#ifdef CODEC_PROFILE
+
+const bool ENABLED = true;
+
+// The Counters of the running threads, and the sum of those of the threads that ended
+class Registry {
+public:
+    void add(Counters* counters) {
+        std::lock_guard<std::mutex> lock(mutex);
+        live.push_back(counters);
+    }
+
+    void remove(Counters* counters) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ended += *counters;
+        std::erase(live, counters);
+    }
+
+    Counters total() {
+        std::lock_guard<std::mutex> lock(mutex);
+        Counters sum = ended;
+        for (const Counters* counters : live) {
+            sum += *counters;
+        }
+        return sum;
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<Counters*> live;
+    Counters ended;
+};
+
+inline Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+struct ThreadCounters : Counters {
+    ThreadCounters() { registry().add(this); }
+    ~ThreadCounters() { registry().remove(this); }
+};
+
+// This thread's
+inline Counters& local() {
+    thread_local ThreadCounters counters;
+    return counters;
+}
+
+inline Counters total() {
+    return registry().total();
+}
+
+// Adds the time from construction to destruction to a stage, less that of the scopes
+// opened inside it on the same thread
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Stage stage) : stage(stage), parent(current()), start(Clock::now()) {
+        current() = this;
+    }
+
+    ~ScopedTimer() {
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        Counters& counters = local();
+        counters.nanoseconds[stage] += elapsed - inner;
+        counters.calls[stage]++;
+        if (parent != nullptr) {
+            parent->inner += elapsed;
+        }
+        current() = parent;
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static ScopedTimer*& current() {
+        thread_local ScopedTimer* innermost = nullptr;
+        return innermost;
+    }
+
+    Stage stage;
+    ScopedTimer* parent;
+    Clock::time_point start;
+    uint64_t inner = 0;
+};
+
+inline void countM(unsigned int m) {
+    local().mLog2[m != 0 ? std::bit_width(m) - 1 : 0]++;
+}
+
+inline void countUnary(unsigned int q) {
+    local().unary[q < UNARY_BUCKETS - 1 ? q : UNARY_BUCKETS - 1]++;
+}
+
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#define PROFILE_SCOPE(stage) profile::ScopedTimer PROFILE_JOIN(profileTimer, __LINE__)(profile::stage)
+#define PROFILE_M(m) profile::countM(m)
+#define PROFILE_UNARY(q) profile::countUnary(q)
+
+#else
+
+const bool ENABLED = false;
+
+inline Counters total() {
+    return Counters();
+}
+
+#define PROFILE_SCOPE(stage)
+#define PROFILE_M(m)
+#define PROFILE_UNARY(q)
+
+#endif
+
+// s as a JSON string
+inline std::string jsonString(const std::string& s) {
+    static const char hex[] = "0123456789abcdef";
+    std::string quoted = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += static_cast<char>(c);
+        } else if (c < 0x20) {
+            quoted += "\\u00";
+            quoted += hex[c >> 4];
+            quoted += hex[c & 15];
+        } else {
+            quoted += static_cast<char>(c);
+        }
+    }
+    return quoted + "\"";
+}
+
+// The counters as a JSON object: per stage, seconds (summed over threads) and scopes
+// entered; the histograms as arrays, trailing zeros left out. null when not built in.
+inline void writeJson(std::ostream& out, const Counters& counters) {
+    if (!ENABLED) {
+        out << "null";
+        return;
+    }
+    auto writeArray = [&](const uint64_t* counts, int size) {
+        while (size > 0 && counts[size - 1] == 0) {
+            size--;
+        }
+        out << "[";
+        for (int b = 0; b < size; b++) {
+            out << (b ? ", " : "") << counts[b];
+        }
+        out << "]";
+    };
+    out << "{\n    \"stages\": {";
+    for (int s = 0; s < STAGES; s++) {
+        out << (s ? "," : "") << "\n      \"" << STAGE_NAMES[s] << "\": {\"seconds\": "
+            << counters.nanoseconds[s] / 1e9 << ", \"calls\": " << counters.calls[s] << "}";
+    }
+    out << "\n    },\n    \"m_log2_histogram\": ";
+    writeArray(counters.mLog2.data(), M_BUCKETS);
+    out << ",\n    \"unary_histogram\": ";
+    writeArray(counters.unary.data(), UNARY_BUCKETS);
+    out << "\n  }";
+}
+
+}
+
+#endif